@@ -0,0 +1,85 @@
+/**
+ * LoRa time on air and Class C fragment pacing
+ */
+
+// MHDR (1) + FHDR without FOpts (7) + FPort (1) + MIC (4)
+const LORAWAN_FRAME_OVERHEAD = 13;
+
+// EU868 data rates
+const DATARATES = [
+    { sf: 12, bw: 125000 },
+    { sf: 11, bw: 125000 },
+    { sf: 10, bw: 125000 },
+    { sf: 9, bw: 125000 },
+    { sf: 8, bw: 125000 },
+    { sf: 7, bw: 125000 },
+    { sf: 7, bw: 250000 },
+];
+
+const DEFAULTS = {
+    codingRate: 1,              // 4/5
+    preambleSymbols: 8,
+    crc: false,                 // downlinks have no payload CRC
+    dutyCycle: 0.1,             // 869.4 - 869.65 MHz band (RX2 frequency)
+    schedulerIntervalMs: 1000,  // loraserver sends at most one Class C downlink per device per scheduler run
+    guardMs: 50,                // gap between two downlinks on the gateway
+};
+
+/**
+ * Time on air of a LoRaWAN frame, in ms
+ *
+ * @param {number} datarate - EU868 data rate (0..6)
+ * @param {number} payloadLength - application payload length (LoRaWAN frame overhead is added)
+ * @param {Object} [opts] - codingRate (1 = 4/5 .. 4 = 4/8), preambleSymbols, crc
+ */
+function timeOnAirMs(datarate, payloadLength, opts) {
+    opts = Object.assign({}, DEFAULTS, opts);
+
+    let dr = DATARATES[datarate];
+    if (!dr) throw new Error('Unknown datarate ' + datarate);
+
+    let tsym = Math.pow(2, dr.sf) / dr.bw * 1000;
+    let de = (dr.bw === 125000 && dr.sf >= 11) ? 1 : 0; // low data rate optimization
+    let pl = payloadLength + LORAWAN_FRAME_OVERHEAD;
+
+    let num = 8 * pl - 4 * dr.sf + 28 + (opts.crc ? 16 : 0);
+    let payloadSymbols = 8 + Math.max(Math.ceil(num / (4 * (dr.sf - 2 * de))) * (opts.codingRate + 4), 0);
+
+    return (opts.preambleSymbols + 4.25) * tsym + payloadSymbols * tsym;
+}
+
+/**
+ * Interval between Class C fragments, limited by the time on air, the gateway duty cycle
+ * and the network server scheduler
+ *
+ * @param {number} datarate - EU868 data rate (0..6)
+ * @param {number} packetLength - length of a fragment packet (FPort 201 payload, including the 3 byte header)
+ * @param {Object} [opts] - see DEFAULTS
+ */
+function fragmentPacing(datarate, packetLength, opts) {
+    opts = Object.assign({}, DEFAULTS, opts);
+
+    let toaMs = timeOnAirMs(datarate, packetLength, opts);
+
+    let limits = {
+        'time on air': toaMs + opts.guardMs,
+        'duty cycle': toaMs / opts.dutyCycle,
+        'scheduler': opts.schedulerIntervalMs,
+    };
+
+    let limitedBy = Object.keys(limits).reduce((a, b) => limits[a] >= limits[b] ? a : b);
+    let intervalMs = Math.ceil(limits[limitedBy]);
+
+    return {
+        toaMs: toaMs,
+        intervalMs: intervalMs,
+        fragmentsPerSecond: 1000 / intervalMs,
+        limitedBy: limitedBy,
+    };
+}
+
+module.exports = {
+    timeOnAirMs: timeOnAirMs,
+    fragmentPacing: fragmentPacing,
+    DEFAULTS: DEFAULTS,
+};
@@ -0,0 +1,685 @@
+/**
+ * FUOTA campaign engine
+ *
+ * Moves every device through the unicast setup (clock sync, multicast group, fragmentation session, Class C session)
+ * on its own, so one slow or offline device does not hold up the rest. Devices are kept in a Map, and the number of
+ * devices per phase is counted, so handling a message does not depend on the size of the fleet.
+ *
+ * The engine does not talk to MQTT itself. Uplinks go in through handleUplink(), and downlinks come out through the
+ * publish function that's passed in, so it can run against a real broker or a stand-in.
+ */
+
+const EventEmitter = require('events');
+const gpsTime = require('gps-time');
+const repair = require('./repair');
+
+const PHASE = {
+    CLOCK_SYNC: 'clock-sync',   // waiting for AppTimeReq
+    MC_SETUP: 'mc-setup',       // McGroupSetupReq sent
+    FRAG_SETUP: 'frag-setup',   // FragSessionSetupReq sent
+    WAITING: 'waiting',         // set up, waiting for the campaign to pick a start time
+    MC_START: 'mc-start',       // McClassCSessionReq sent
+    READY: 'ready',             // McClassCSessionAns received, will switch to Class C
+    COMPLETE: 'complete',       // reconstructed the image (FragSessionStatusAns without missing fragments)
+    MISSED: 'missed',           // set up too late for the Class C session, joins the next repair round
+    FAILED: 'failed',           // rejected a request, or ran out of retries
+};
+
+const DEFAULTS = {
+    classCWaitS: 15,            // Class C session starts at least this long after the start time was picked
+    leadUplinks: 3,             // and late enough for this many uplinks per device, at the fleet's uplink interval
+    classCMinLeadS: 5,          // devices need the McClassCSessionReq at least this long before the start
+    classCSendDelayS: 10,       // start sending fragments at most this long after the Class C session starts
+    classCGuardMarginS: 1,      // guard band on top of the latest device start (uplink latency, rounding to seconds)
+    setupTimeoutS: 120,         // after the first device is set up, wait this long for the others
+    retryBaseMs: 20000,         // first retry of a request
+    retryMaxMs: 300000,         // retries back off up to this interval
+    maxAttempts: 8,             // attempts per request before a device is marked as failed
+    maxQueue: 4,                // downlinks that can wait per device
+    datarate: 0,
+    downlinkFreq: 869525000,
+    sessionTimeout: 0x07,       // 2^7 seconds
+    completionTarget: 1.0,      // share of the Class C devices that needs to be complete before 'done' is emitted
+    repairSample: 10,           // devices that are asked for their FragSessionStatus after every pass
+    repairStatusTimeoutS: 300,  // wait this long for the sampled devices to answer
+    maxRepairRounds: 3,         // Class C sessions with extra parity after the first pass
+    maxRedundancy: null,        // parity the devices can use (lorawan-update-client.max-redundancy), null if unknown
+    mcGroupId: 0,               // multicast group (0..3), campaigns on different groups can run at the same time
+    mcAddr: 0x01FFFFFF,         // McAddr of the group, the session keys are derived from it
+};
+
+// McKey_encrypted, the same key for every group, the group's session keys differ through McAddr
+const MC_KEY_ENCRYPTED = [ 0x01, 0x5E, 0x85, 0xF4, 0xB9, 0x9D, 0xC0, 0xB9, 0x44, 0x06, 0x6C, 0xD0, 0x74, 0x98, 0x33, 0x0B ];
+
+function gpsNow() {
+    return gpsTime.toGPSMS(Date.now()) / 1000 | 0;
+}
+
+class Campaign extends EventEmitter {
+    /**
+     * @param {Object} opts
+     * @param {string[]} opts.devices - device EUIs to update
+     * @param {number[]} opts.fragSessionSetup - FragSessionSetupReq (first row of the packets file)
+     * @param {number} [opts.mcGroupId] - multicast group, answers for other groups are left to their own campaign
+     * @param {number} [opts.mcAddr] - McAddr of the multicast group
+     * @param {function} opts.publish - publish(devEUI, applicationID, message) queues a downlink with the network server
+     * @param {function} [opts.now] - current GPS time in seconds
+     * @param {Object} [opts.timers] - setTimeout / clearTimeout implementation
+     */
+    constructor(opts) {
+        super();
+
+        this.opts = Object.assign({}, DEFAULTS, opts);
+        this.now = this.opts.now || gpsNow;
+        this.timers = this.opts.timers || { setTimeout: setTimeout, clearTimeout: clearTimeout };
+
+        this.devices = new Map();
+        this.counts = {};
+        Object.keys(PHASE).forEach(k => this.counts[PHASE[k]] = 0);
+
+        for (let eui of this.opts.devices) {
+            if (this.devices.has(eui)) continue;
+
+            this.devices.set(eui, {
+                eui: eui,
+                applicationID: null,
+                phase: PHASE.CLOCK_SYNC,
+                attempts: 0,
+                retryTimer: null,
+                queue: [],
+                reason: null,
+                startDeltaS: null,      // how much later than the start time the device switches to Class C
+                lastUplinkS: null,
+                uplinkIntervalS: null,  // average time between uplinks, outside of Class C sessions
+                status: null,           // last FragSessionStatusAns, { received, missing, sent, passReceived, passSent }
+                reported: null,         // { received, sent } of the device's previous FragSessionStatusAns
+                sent: 0,                // fragments sent in the Class C sessions that the device was in
+            });
+            this.counts[PHASE.CLOCK_SYNC]++;
+        }
+
+        this.mcGroupId = this.opts.mcGroupId & 0x3;
+        this.fragIndex = (this.opts.fragSessionSetup[1] >> 4) & 0x3;
+
+        this.startTime = null;
+        this.setupTimer = null;
+        this.classCStarted = false;
+        this.participants = 0;          // devices in the Class C session
+        this.done = false;
+
+        this.sent = 0;                  // fragments sent in the fragmentation session, over all passes
+        this.repairRound = 0;
+        this.repairParity = 0;          // parity fragments to send in the current repair round
+        this.statusAsked = [];          // devices asked for their status after the last pass
+        this.statusSample = null;       // of which the ones that did not answer yet
+        this.statusTimer = null;
+    }
+
+    get size() {
+        return this.devices.size;
+    }
+
+    /**
+     * Handle an uplink from the network server (payload of an application/+/device/+/rx message)
+     */
+    handleUplink(m) {
+        let dev = this.devices.get(m.devEUI);
+        if (!dev) return; // device that we don't care about
+
+        dev.applicationID = m.applicationID;
+        this._trackUplink(dev);
+
+        let body = Buffer.from(m.data || '', 'base64');
+
+        if (m.fPort === 202 /* clock sync */) {
+            this._onClockSync(dev, body);
+        }
+        else if (m.fPort === 200 /* mc group cmnds */) {
+            this._onMcGroup(dev, body);
+        }
+        else if (m.fPort === 201 /* frag session */) {
+            this._onFragSession(dev, body);
+        }
+
+        // Class A, so a downlink can only go out after an uplink
+        this._flush(dev);
+    }
+
+    /**
+     * Number of devices in every phase
+     */
+    summary() {
+        return Object.assign({}, this.counts);
+    }
+
+    /**
+     * Share of the devices in the Class C session that reconstructed the image
+     */
+    completedShare() {
+        if (this.participants === 0) return 0;
+        return this.counts[PHASE.COMPLETE] / this.participants;
+    }
+
+    /**
+     * Time between the start of the Class C session and the first fragment. Every device reported its time to start
+     * in McClassCSessionAns, so this only needs to cover the latest one (plus a margin), rather than the worst case.
+     * Devices that did not answer yet are assumed to be at the maximum (classCSendDelayS).
+     */
+    guardBandS() {
+        let latest = 0;
+        for (let dev of this.devices.values()) {
+            if (dev.phase === PHASE.MC_START) return this.opts.classCSendDelayS;
+            if (dev.phase !== PHASE.READY || dev.startDeltaS === null) continue;
+            latest = Math.max(latest, dev.startDeltaS);
+        }
+        return Math.min(latest + this.opts.classCGuardMarginS, this.opts.classCSendDelayS);
+    }
+
+    /**
+     * Time between uplinks that 90% of the devices beat, null until devices sent a second uplink.
+     * Class A devices only get a downlink after an uplink, so this sets how long reaching all of them takes.
+     */
+    uplinkIntervalS() {
+        let intervals = [];
+        for (let dev of this.devices.values()) {
+            if (dev.uplinkIntervalS !== null) intervals.push(dev.uplinkIntervalS);
+        }
+        if (intervals.length === 0) return null;
+
+        intervals.sort((a, b) => a - b);
+        return intervals[Math.ceil(intervals.length * 0.9) - 1];
+    }
+
+    /**
+     * Time between picking the start time and the start of the Class C session: long enough for every device to get
+     * the McClassCSessionReq in Class A (leadUplinks uplinks), but at least classCWaitS
+     */
+    leadTimeS() {
+        let interval = this.uplinkIntervalS();
+        if (interval === null) return this.opts.classCWaitS;
+
+        let lead = Math.ceil(this.opts.classCMinLeadS + this.opts.leadUplinks * interval);
+        return Math.max(lead, this.opts.classCWaitS);
+    }
+
+    /**
+     * Devices that will take part in the Class C session
+     */
+    readyDevices() {
+        let ready = [];
+        for (let dev of this.devices.values()) {
+            if (dev.phase === PHASE.READY || dev.phase === PHASE.MC_START) ready.push(dev.eui);
+        }
+        return ready;
+    }
+
+    /**
+     * The multicast stream of a pass (the first pass or a repair round) was sent. When the Class C window has closed,
+     * a sample of the devices that are not complete is asked for their FragSessionStatus, and a repair round with
+     * as much parity as the sample needs is scheduled (emits 'repair', or 'repairs-exhausted').
+     *
+     * @param {number} sent - fragments sent in this pass
+     */
+    passDone(sent) {
+        this.sent += sent;
+        for (let dev of this.devices.values()) {
+            if (dev.phase === PHASE.READY || dev.phase === PHASE.COMPLETE) dev.sent += sent;
+        }
+        if (this.done) return;
+
+        // devices only answer in Class A
+        let windowEnd = this.startTime + Math.pow(2, this.opts.sessionTimeout);
+        let waitS = Math.max(windowEnd - this.now(), 0);
+
+        this.statusTimer = this.timers.setTimeout(() => {
+            this.statusTimer = null;
+            this._requestStatus();
+        }, waitS * 1000);
+    }
+
+    // Devices that are set up but not complete: the ones in the Class C session, and the ones that missed it
+    _incompleteDevices() {
+        let incomplete = [];
+        for (let dev of this.devices.values()) {
+            if (dev.phase === PHASE.READY || dev.phase === PHASE.MC_START || dev.phase === PHASE.MISSED) incomplete.push(dev.eui);
+        }
+        return incomplete;
+    }
+
+    _requestStatus() {
+        if (this.done) return;
+
+        let candidates = this._incompleteDevices();
+        for (let ix = candidates.length - 1; ix > 0; ix--) {
+            let j = Math.random() * (ix + 1) | 0;
+            [ candidates[ix], candidates[j] ] = [ candidates[j], candidates[ix] ];
+        }
+
+        this.statusAsked = candidates.slice(0, this.opts.repairSample);
+        this.statusSample = new Set(this.statusAsked);
+        if (this.statusSample.size === 0) return this._repair();
+
+        console.log('Asking', this.statusSample.size, 'of', candidates.length, 'devices for their FragSessionStatus');
+        for (let eui of this.statusSample) {
+            let dev = this.devices.get(eui);
+            dev.status = null;
+            this._enqueue(dev, 201, [ 0x01, (this.fragIndex << 1) | 0x1 /* all participants */ ]);
+        }
+
+        this.statusTimer = this.timers.setTimeout(() => {
+            this.statusTimer = null;
+            this._repair();
+        }, this.opts.repairStatusTimeoutS * 1000);
+    }
+
+    // Size the next repair round from the statuses that came in, and schedule its Class C session
+    _repair() {
+        if (!this.statusSample) return;
+
+        let sampled = this.statusAsked.map(eui => this.devices.get(eui).status).filter(s => s !== null);
+        this.statusSample = null;
+        if (this.statusTimer) {
+            this.timers.clearTimeout(this.statusTimer);
+            this.statusTimer = null;
+        }
+
+        let incomplete = this._incompleteDevices().length;
+        if (this.done || incomplete === 0) return;
+
+        if (this.repairRound >= this.opts.maxRepairRounds) {
+            console.log('No repair rounds left,', incomplete, 'devices are not complete');
+            return this.emit('repairs-exhausted', this.summary());
+        }
+        if (sampled.length === 0) {
+            console.log('None of the sampled devices answered, no repair round');
+            return this.emit('repairs-exhausted', this.summary());
+        }
+
+        // devices that were not in any session yet miss everything, they join this round as well
+        let nbFrag = this.opts.fragSessionSetup[2] | (this.opts.fragSessionSetup[3] << 8);
+        if (this._incompleteDevices().some(eui => this.devices.get(eui).sent === 0)) {
+            sampled.push({ received: 0, missing: nbFrag, sent: 0 });
+        }
+
+        // the round is sized for the worst device in the sample
+        let result = repair.repairParity(sampled, { nbFrag: nbFrag });
+        if (result.parity === 0) {
+            console.log('The sampled devices need no more parity,', incomplete, 'devices are not complete');
+            return this.emit('repairs-exhausted', this.summary());
+        }
+
+        // the devices ignore parity beyond what they have room for
+        if (this.opts.maxRedundancy !== null) {
+            let room = this.opts.maxRedundancy - Math.max(this.sent - nbFrag, 0);
+            if (room <= 0) {
+                console.log('Devices cannot use more parity (max. redundancy', this.opts.maxRedundancy + '), no repair round');
+                return this.emit('repairs-exhausted', this.summary());
+            }
+            result.parity = Math.min(result.parity, room);
+        }
+
+        this.repairRound++;
+        this.repairParity = result.parity;
+        console.log('Repair round', this.repairRound + ':', result.parity, 'parity fragments for', incomplete, 'devices',
+            '(sample needs', result.perDevice.join(', ') + ')');
+
+        // the incomplete devices go through a new Class C session, also the ones that missed the last one
+        this.startTime = null;
+        this.classCStarted = false;
+        for (let dev of this.devices.values()) {
+            if (dev.phase === PHASE.READY || dev.phase === PHASE.MISSED) this._setPhase(dev, PHASE.WAITING);
+        }
+        this.emit('repair', this.repairRound, result.parity);
+        this._pickStartTime('repair round ' + this.repairRound);
+    }
+
+    stop() {
+        for (let dev of this.devices.values()) {
+            this._clearRetry(dev);
+        }
+        if (this.statusTimer) {
+            this.timers.clearTimeout(this.statusTimer);
+            this.statusTimer = null;
+        }
+        if (this.setupTimer) {
+            this.timers.clearTimeout(this.setupTimer);
+            this.setupTimer = null;
+        }
+    }
+
+    _onClockSync(dev, body) {
+        if (body[0] !== 0x1 /* CLOCK_APP_TIME_REQ */) {
+            return console.warn('Could not handle clock sync request', dev.eui, body);
+        }
+
+        let deviceTime = body[1] + (body[2] << 8) + (body[3] << 16) + (body[4] << 24);
+        let serverTime = this.now();
+        let adjust = serverTime - deviceTime | 0;
+        let tokenReq = body[5] & 0xf;
+
+        // always answered, also for devices that are further along
+        this._enqueue(dev, 202, [ 1, adjust & 0xff, (adjust >> 8) & 0xff, (adjust >> 16) & 0xff, (adjust >> 24) & 0xff, tokenReq ]);
+
+        console.log('Clock sync for device', dev.eui, adjust, 'seconds');
+
+        if (dev.phase === PHASE.CLOCK_SYNC) {
+            this._advance(dev, PHASE.MC_SETUP);
+        }
+    }
+
+    _onMcGroup(dev, body) {
+        // another campaign's multicast group
+        if ((body[0] === 0x2 || body[0] === 0x4) && (body[1] & 0x3) !== this.mcGroupId) return;
+
+        if (body[0] === 0x2) { // McGroupSetupAns
+            if (dev.phase !== PHASE.MC_SETUP) return;
+
+            if (body[1] & 0x4 /* IDerror */) {
+                return this._fail(dev, 'McGroupSetupAns ' + body.toString('hex'));
+            }
+            this._advance(dev, PHASE.FRAG_SETUP);
+        }
+        else if (body[0] === 0x4) { // McClassCSessionAns
+            if (dev.phase !== PHASE.MC_START) return;
+
+            if (body[1] & 0x3c /* error flags */) {
+                return this._fail(dev, 'McClassCSessionAns ' + body.toString('hex'));
+            }
+
+            // the device calculates TimeToStart when it sends the answer, so this is the offset of its clock
+            // (corrected for its drift), plus the uplink latency
+            let tts = body[2] + (body[3] << 8) + (body[4] << 16);
+            let delta = this.now() + tts - this.startTime;
+            dev.startDeltaS = delta;
+            if (delta + this.opts.classCGuardMarginS > this.opts.classCSendDelayS) {
+                console.log('Delta is too big for', dev.eui, delta, 'seconds, it will miss the first fragments');
+            }
+
+            this._advance(dev, PHASE.READY);
+        }
+        else {
+            console.warn('Could not handle Mc Group command', dev.eui, body);
+        }
+    }
+
+    _onFragSession(dev, body) {
+        if (body[0] === 0x2) { // FragSessionSetupAns
+            if ((body[1] >> 6) !== this.fragIndex) return; // another campaign's fragmentation session
+            if (dev.phase !== PHASE.FRAG_SETUP) return;
+
+            if (body[1] & 0x0f) {
+                return this._fail(dev, 'FragSessionSetupAns status ' + (body[1] & 0x0f));
+            }
+            this._advance(dev, PHASE.WAITING);
+        }
+        else if (body[0] === 0x1) { // FragSessionStatusAns
+            if (body.length < 5 || (body[2] >> 6) !== this.fragIndex) return;
+
+            let received = (body[1] | (body[2] << 8)) & 0x3fff;
+            let missing = body[3];
+            dev.status = { received: received, missing: missing, sent: dev.sent };
+            if (dev.reported && dev.sent > dev.reported.sent) {
+                // what the device lost in the sessions since its previous status
+                dev.status.passReceived = Math.max(received - dev.reported.received, 0);
+                dev.status.passSent = dev.sent - dev.reported.sent;
+            }
+            dev.reported = { received: received, sent: dev.sent };
+
+            if (missing === 0 && body[4] === 0) {
+                this._onDeviceComplete(dev, received + ' fragments received');
+            }
+
+            if (this.statusSample && this.statusSample.has(dev.eui)) {
+                this.statusSample.delete(dev.eui);
+                if (this.statusSample.size === 0) this._repair();
+            }
+        }
+        else if (body[0] === 0x5) { // DATA_BLOCK_AUTH_REQ
+            let hash = '';
+            for (let ix = 5; ix > 1; ix--) {
+                hash += body.slice(ix, ix+1).toString('hex');
+            }
+            console.log('Received DATA_BLOCK_AUTH_REQ', dev.eui, hash);
+            this.emit('authreq', dev.eui, hash);
+            this._onDeviceComplete(dev, 'hash ' + hash);
+        }
+        else {
+            console.warn('Could not handle Frag Session command', dev.eui, body);
+        }
+    }
+
+    _onDeviceComplete(dev, details) {
+        // devices that were not in the Class C session (e.g. still complete from an earlier campaign) don't count
+        if (dev.phase !== PHASE.READY && dev.phase !== PHASE.MC_START) return;
+
+        this._setPhase(dev, PHASE.COMPLETE);
+        console.log('Device', dev.eui, 'is complete (' + details + '),', this.counts[PHASE.COMPLETE], 'of', this.participants, 'devices');
+        this.emit('complete', dev.eui);
+
+        this._checkDone();
+    }
+
+    // Emit 'done' once, when enough devices in the Class C session are complete
+    _checkDone() {
+        if (this.done || !this.classCStarted || this.participants === 0) return;
+
+        if (this.completedShare() >= this.opts.completionTarget) {
+            this.done = true;
+            this.emit('done', this.summary());
+        }
+    }
+
+    // Move a device to the next phase, and send the request for that phase
+    _advance(dev, phase) {
+        this._setPhase(dev, phase);
+        this._clearRetry(dev);
+        dev.attempts = 0;
+
+        switch (phase) {
+            case PHASE.MC_SETUP:
+            case PHASE.FRAG_SETUP:
+            case PHASE.MC_START:
+                this._request(dev);
+                break;
+
+            case PHASE.WAITING:
+                this._onDeviceWaiting(dev);
+                break;
+        }
+
+        this._checkSetupDone();
+    }
+
+    _request(dev) {
+        switch (dev.phase) {
+            case PHASE.MC_SETUP:
+                this._enqueue(dev, 200, this._mcGroupSetupReq());
+                break;
+            case PHASE.FRAG_SETUP:
+                this._enqueue(dev, 201, this.opts.fragSessionSetup);
+                break;
+            case PHASE.MC_START:
+                this._enqueue(dev, 200, this._mcClassCSessionReq());
+                break;
+            default:
+                return;
+        }
+
+        dev.attempts++;
+
+        // retry with back-off (and some jitter so devices spread out) until the device answers
+        let delay = Math.min(this.opts.retryBaseMs * Math.pow(2, dev.attempts - 1), this.opts.retryMaxMs);
+        delay += Math.random() * delay * 0.1 | 0;
+
+        dev.retryTimer = this.timers.setTimeout(() => {
+            dev.retryTimer = null;
+
+            if (dev.attempts >= this.opts.maxAttempts) {
+                return this._fail(dev, 'no answer in ' + dev.phase + ' after ' + dev.attempts + ' attempts');
+            }
+            if (dev.phase === PHASE.MC_START && this.now() > this.startTime - this.opts.classCMinLeadS) {
+                return this._setPhase(dev, PHASE.MISSED);
+            }
+            this._request(dev);
+        }, delay);
+    }
+
+    _onDeviceWaiting(dev) {
+        if (this.startTime === null) {
+            // first device that's ready, don't wait for the others forever
+            if (!this.setupTimer) {
+                this.setupTimer = this.timers.setTimeout(() => {
+                    this.setupTimer = null;
+                    this._pickStartTime('setup timeout');
+                }, this.opts.setupTimeoutS * 1000);
+            }
+            return;
+        }
+
+        // start time was already picked, join if there's still time
+        if (this.now() <= this.startTime - this.opts.classCMinLeadS) {
+            this._advance(dev, PHASE.MC_START);
+        }
+        else {
+            this._setPhase(dev, PHASE.MISSED);
+        }
+    }
+
+    // Pick the start time as soon as no device can make it any further in the setup
+    _checkSetupDone() {
+        if (this.startTime !== null || this.counts[PHASE.WAITING] === 0) return;
+
+        let settled = this.counts[PHASE.WAITING] + this.counts[PHASE.FAILED];
+        if (settled === this.devices.size) {
+            this._pickStartTime('all devices set up');
+        }
+    }
+
+    _pickStartTime(reason) {
+        if (this.startTime !== null) return;
+
+        if (this.setupTimer) {
+            this.timers.clearTimeout(this.setupTimer);
+            this.setupTimer = null;
+        }
+
+        let leadS = this.leadTimeS();
+        this.startTime = this.now() + leadS;
+        console.log('Class C session starts at', this.startTime, 'in', leadS, 'seconds (' + reason + ',', this.counts[PHASE.WAITING], 'devices set up)');
+
+        for (let dev of this.devices.values()) {
+            if (dev.phase === PHASE.WAITING) {
+                this._advance(dev, PHASE.MC_START);
+            }
+        }
+
+        // at the start time, wait until the latest device is listening (see guardBandS())
+        this.timers.setTimeout(() => {
+            let guardS = this.guardBandS();
+            console.log('Class C guard band is', guardS, 'seconds');
+
+            this.timers.setTimeout(() => {
+                let ready = this.readyDevices();
+                this.classCStarted = true;
+                // devices that missed this session are served in the next repair round, so they count as well
+                this.participants = ready.length + this.counts[PHASE.COMPLETE] + this.counts[PHASE.MISSED];
+                this.emit('classc', ready, this.summary());
+                this._checkDone();
+            }, guardS * 1000);
+        }, leadS * 1000);
+
+        this.emit('starttime', this.startTime);
+    }
+
+    _mcGroupSetupReq() {
+        let addr = this.opts.mcAddr;
+        return [ 0x02, this.mcGroupId,
+            addr & 0xff, (addr >> 8) & 0xff, (addr >> 16) & 0xff, (addr >>> 24) & 0xff, // McAddr
+        ].concat(MC_KEY_ENCRYPTED, [
+            0x0, 0x0, 0x0, 0x0, // minFCnt
+            0xff, 0x0, 0x0, 0x0 // maxFCnt
+        ]);
+    }
+
+    _mcClassCSessionReq() {
+        let startTime = this.startTime;
+        let freq = this.opts.downlinkFreq / 100;
+        return [
+            0x4,
+            this.mcGroupId, // mcgroupidheader
+            startTime & 0xff, (startTime >> 8) & 0xff, (startTime >> 16) & 0xff, (startTime >> 24) & 0xff,
+            this.opts.sessionTimeout,
+            freq & 0xff, (freq >> 8) & 0xff, (freq >> 16) & 0xff, // dlfreq
+            this.opts.datarate // dr
+        ];
+    }
+
+    // Queue a downlink, a waiting downlink with the same port and command is replaced
+    _enqueue(dev, port, data) {
+        let msg = {
+            "reference": "fuota" + Date.now(),
+            "confirmed": false,
+            "fPort": port,
+            "data": Buffer.from(data).toString('base64')
+        };
+
+        let existing = dev.queue.findIndex(q => q.fPort === port && q.cmd === data[0]);
+        if (existing !== -1) {
+            dev.queue[existing] = { fPort: port, cmd: data[0], msg: msg };
+            return;
+        }
+
+        if (dev.queue.length >= this.opts.maxQueue) {
+            console.warn('Downlink queue full for', dev.eui, 'dropping oldest message');
+            dev.queue.shift();
+        }
+        dev.queue.push({ fPort: port, cmd: data[0], msg: msg });
+    }
+
+    _flush(dev) {
+        if (dev.queue.length === 0 || dev.applicationID === null) return;
+
+        let q = dev.queue.shift();
+        this.opts.publish(dev.eui, dev.applicationID, q.msg);
+    }
+
+    _fail(dev, reason) {
+        console.warn('Device', dev.eui, 'failed:', reason);
+        dev.reason = reason;
+        this._clearRetry(dev);
+        this._setPhase(dev, PHASE.FAILED);
+        this._checkSetupDone();
+    }
+
+    // Average time between uplinks. Uplinks while the device is in a Class C session are not counted,
+    // the gap includes the session, and devices queue their answers until it ends.
+    _trackUplink(dev) {
+        let now = this.now();
+
+        if (dev.lastUplinkS !== null && dev.phase !== PHASE.READY) {
+            let interval = now - dev.lastUplinkS;
+            dev.uplinkIntervalS = dev.uplinkIntervalS === null ? interval : dev.uplinkIntervalS * 0.75 + interval * 0.25;
+        }
+        dev.lastUplinkS = now;
+    }
+
+    _clearRetry(dev) {
+        if (dev.retryTimer) {
+            this.timers.clearTimeout(dev.retryTimer);
+            dev.retryTimer = null;
+        }
+    }
+
+    _setPhase(dev, phase) {
+        if (dev.phase === phase) return;
+
+        this.counts[dev.phase]--;
+        this.counts[phase]++;
+        dev.phase = phase;
+        this.emit('phase', dev.eui, phase);
+    }
+}
+
+Campaign.PHASE = PHASE;
+
+module.exports = Campaign;
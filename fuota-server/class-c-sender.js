@@ -0,0 +1,118 @@
+/**
+ * Sends the multicast fragments of a Class C session, used by loraserver.js and by fleet-sim.js
+ *
+ * The first pass sends the fragments of the fragmenter (a signed binary) or the rows of a packets file, a repair round
+ * only new parity, as much as the campaign asked for. Fragments are paced from their time on air, the gateway duty
+ * cycle and the network server scheduler (see airtime.js), and sending stops when the campaign is done.
+ *
+ * Time goes through opts.now and opts.timers, so the same loop runs in real time and in the simulator.
+ */
+
+const airtime = require('./airtime');
+
+const DEFAULTS = {
+    datarate: 0,
+    dutyCycle: 0.1,             // GW_DUTY_CYCLE
+    schedulerIntervalMs: 1000,  // NS_SCHEDULER_INTERVAL_MS
+    fragmenter: null,           // Fragmenter of a signed binary
+    packets: null,              // or the rows of a packets file, without the header
+    publish: null,              // publish(msg) queues a downlink on the multicast device
+    now: Date.now,              // current time in ms
+    timers: { setTimeout: setTimeout },
+};
+
+/**
+ * Interval between fragments of packetLength bytes (FPort 201 payload), see airtime.fragmentPacing()
+ */
+function pacing(packetLength, opts) {
+    opts = Object.assign({}, DEFAULTS, opts);
+
+    return airtime.fragmentPacing(opts.datarate, packetLength, {
+        dutyCycle: opts.dutyCycle,
+        schedulerIntervalMs: opts.schedulerIntervalMs,
+    });
+}
+
+/**
+ * Send the fragments of the campaign's current pass (the first pass, or repair round campaign.repairRound).
+ * Calls campaign.passDone() when it's done, if there's a fragmenter (a packets file has a fixed amount of parity).
+ * Throws if a repair round is asked for without a fragmenter.
+ *
+ * @param {Campaign} campaign
+ * @param {Object} opts - see DEFAULTS
+ * @returns {Object} packetCount: fragments in this pass, pacing: see airtime.fragmentPacing()
+ */
+function send(campaign, opts) {
+    opts = Object.assign({}, DEFAULTS, opts);
+
+    let fragmenter = opts.fragmenter;
+    let packets = fragmenter ? fragmenter.packets() : opts.packets[Symbol.iterator]();
+    let packetCount = fragmenter ? fragmenter.nbFrag + fragmenter.redundancy : opts.packets.length;
+
+    // a repair round only sends new parity, as much as the devices that were asked need
+    if (campaign.repairRound > 0) {
+        // a packets file has no more parity than its rows (and never calls passDone(), so no repair round starts)
+        if (!fragmenter) {
+            throw new Error('Repair round ' + campaign.repairRound + ' needs a fragmenter, a packets file has no parity to add');
+        }
+        packetCount = campaign.repairParity;
+        packets = (function*() {
+            for (let ix = 0; ix < packetCount; ix++) {
+                let p = fragmenter.nextParityPacket();
+                if (!p) return;
+                yield p;
+            }
+        })();
+        console.log('Repair round', campaign.repairRound + ',', packetCount, 'parity fragments');
+    }
+    let packetLength = fragmenter ? fragmenter.fragSize + 3 : Math.max.apply(null, opts.packets.map(p => p.length));
+
+    let p = pacing(packetLength, opts);
+
+    console.log('Pacing: DR' + opts.datarate + ',', p.toaMs.toFixed(0), 'ms on air,', p.intervalMs, 'ms per fragment',
+        '(limited by ' + p.limitedBy + '),', p.fragmentsPerSecond.toFixed(2), 'fragments/s');
+    console.log('Projected session duration:', (packetCount * p.intervalMs / 1000).toFixed(0), 'seconds for', packetCount, 'fragments');
+
+    let start = opts.now();
+    let counter = 0;
+
+    let done = () => {
+        let elapsed = (opts.now() - start) / 1000;
+        console.log('Done sending all packets,', counter, 'fragments in', elapsed.toFixed(0), 'seconds (' + (counter / elapsed).toFixed(2), 'fragments/s)');
+
+        if (fragmenter) {
+            campaign.passDone(counter);
+        }
+    };
+
+    let next = () => {
+        // devices that are complete leave Class C and report back, no need to send the rest
+        if (campaign.done) {
+            console.log('Stopping the Class C session,', packetCount - counter, 'fragments not sent');
+            return done();
+        }
+
+        let packet = packets.next();
+        if (packet.done) return done();
+
+        opts.publish({
+            "reference": "jan" + opts.now(),
+            "confirmed": false,
+            "fPort": 201,
+            "data": Buffer.from(packet.value).toString('base64')
+        });
+
+        console.log('Sent packet', ++counter);
+
+        // scheduled against the start, so time spent publishing does not add up
+        opts.timers.setTimeout(next, Math.max(start + counter * p.intervalMs - opts.now(), 0));
+    };
+    next();
+
+    return { packetCount: packetCount, pacing: p };
+}
+
+module.exports = {
+    pacing: pacing,
+    send: send,
+};
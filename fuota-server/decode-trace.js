@@ -0,0 +1,65 @@
+/**
+ * Decodes the binary trace log (source/helpers/trace_log_helper.h, enabled with the trace-log option) back into text
+ *
+ * Usage: node decode-trace.js [LOGFILE]     (reads stdin if no file is given, other lines are passed through)
+ *   e.g. mbed sterm | node fuota-server/decode-trace.js
+ */
+
+const fs = require('fs');
+const readline = require('readline');
+
+const HEAP_POINTS = [ 'CONNECTED', 'CLASSA', 'CLASSC' ];
+
+// keep in sync with trace_event_t
+const EVENTS = {
+    0x01: () => 'Boot',
+    0x02: (a0, a1, a2) => `Received ${a2} bytes on port ${a0}`,
+    0x03: (a0, a1, a2) => `${a2} bytes scheduled for transmission on port ${a0}`,
+    0x04: (a0, a1, a2) => a0 ? `Message Sent to Network Server, uplink on port ${a0} was queued for ${a2} ms` : 'Message Sent to Network Server',
+    0x05: (a0) => `Transmission Error - EventCode = ${a0}`,
+    0x06: (a0, a1, a2) => `Error in reception - Code = ${a0 || (a2 | 0)}`,
+    0x07: (a0, a1, a2) => `Fragment ${a1} (session ${a0}), status ${a2}`,
+    0x08: (a0, a1, a2) => `Failed to handle UC command on port ${a0}, status ${a2}`,
+    0x09: () => 'Switch to Class A',
+    0x0A: (a0, a1, a2) => `Switch to Class C (group ${a1}, DR${a0}, ${a2} Hz)`,
+    0x0B: (a0, a1, a2) => `${HEAP_POINTS[a0] || a0} heap: current ${a2} bytes`,
+    0x0C: (a0, a1, a2) => `${HEAP_POINTS[a0] || a0} heap: max ${a2} bytes`,
+    0x0D: (a0) => `Frag session ${a0} is complete`,
+    0x0E: (a0, a1, a2) => `Next uplink in ${a2} ms (DR${a0})`,
+    0x0F: (a0, a1, a2) => `!! ${a2} trace entries were dropped, increase trace-log-size`,
+};
+
+/**
+ * @param {string} line - '#T ' followed by 24 hex characters
+ * @returns {string|null} null if the line is not a trace entry
+ */
+function decodeLine(line) {
+    let m = line.trim().match(/^#T ([0-9a-fA-F]{24})$/);
+    if (!m) return null;
+
+    let entry = Buffer.from(m[1], 'hex');
+    let time = entry.readUInt32BE(0);
+    let event = entry[4];
+    let arg0 = entry[5];
+    let arg1 = entry.readUInt16BE(6);
+    let arg2 = entry.readUInt32BE(8);
+
+    let format = EVENTS[event];
+    let text = format ? format(arg0, arg1, arg2) : `Unknown event 0x${event.toString(16)} (${arg0}, ${arg1}, ${arg2})`;
+
+    return `[${(time / 1000).toFixed(3).padStart(10)}] ${text}`;
+}
+
+module.exports = {
+    decodeLine: decodeLine,
+};
+
+if (require.main === module) {
+    let input = process.argv[2] ? fs.createReadStream(process.argv[2]) : process.stdin;
+    let rl = readline.createInterface({ input: input });
+
+    rl.on('line', line => {
+        let decoded = decodeLine(line);
+        console.log(decoded === null ? line : decoded);
+    });
+}
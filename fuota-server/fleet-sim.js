@@ -0,0 +1,575 @@
+/**
+ * Fleet simulator, load tests the FUOTA campaign engine without devices or a network server
+ *
+ * Simulates N end devices that speak the same application protocol as source/main.cpp (clock sync on port 202,
+ * multicast setup on port 200, fragmentation on port 201). They talk to campaign.js through an in-process stand-in
+ * for the MQTT broker, with the same application/<id>/device/<eui>/rx|tx topics as LoRa Server, and the multicast
+ * stream is sent by the same class-c-sender.js as loraserver.js uses. Time is simulated (discrete events), so a campaign of hours runs in
+ * seconds, and the CPU time that is reported for the server is the time spent in the campaign engine and the
+ * fragmenter only.
+ *
+ * Usage: node fleet-sim.js [--devices 1000] [--downlink-loss 0.1] [--fragment-loss 0.05] ...   (see OPTIONS)
+ *   e.g. for n in 100 1000 10000; do node fleet-sim.js --devices $n; done
+ */
+
+const Campaign = require('./campaign');
+const Fragmenter = require('./fragmenter');
+const classCSender = require('./class-c-sender');
+
+const OPTIONS = {
+    'devices': 1000,                // number of simulated devices
+    'seed': 1,                      // seed for the device parameters and losses
+    'file-size': 20 * 1024,         // size of the simulated update file, in bytes
+    'dr': 5,                        // data rate of the multicast stream
+    'redundancy': 0.05,             // parity in the first pass, share of the data fragments
+    'completion-target': 1.0,       // COMPLETION_TARGET of the campaign
+    'class-c-wait': 15,             // CLASS_C_WAIT_S of loraserver.js
+    'gw-duty-cycle': Number(process.env.GW_DUTY_CYCLE || 0.1),                         // GW_DUTY_CYCLE of loraserver.js
+    'ns-scheduler-interval-ms': Number(process.env.NS_SCHEDULER_INTERVAL_MS || 1000),  // NS_SCHEDULER_INTERVAL_MS of loraserver.js
+    'join-spread': 60,              // devices come online over this many seconds
+    'uplink-interval': 10,          // seconds between application uplinks (+/- 50%), main.cpp sends when the duty cycle allows
+    'answer-delay': 5,              // seconds until a device sends a queued answer (duty cycle, tx scheduling)
+    'network-latency': 0.5,         // seconds between the gateway and the server, both ways (+/- 50%)
+    'downlink-loss': 0.05,          // chance that a Class A downlink does not arrive
+    'fragment-loss': 0.1,           // per device, the chance to lose a multicast fragment is 0..2x this
+    'clock-offset': 30,             // devices boot with a clock that is off by up to this many seconds
+    'drift-ppm': 50,                // and runs off by up to this much
+    'decode-overhead': 0.03,        // devices need this much more than nbFrag fragments to decode (share of missing)
+    'max-hours': 24,                // stop the simulation after this long
+    'verbose': false,               // keep the campaign's console output
+};
+
+const MC_APPLICATION_ID = '1';
+const MC_DEV_EUI = '00a99d4921b26d76';
+const GPS_EPOCH_S = 1200000000;     // GPS time at the start of the simulation
+
+// --- simulation core ---
+
+// xorshift32, so runs with the same seed are the same (the campaign's own jitter uses Math.random)
+function prng(seed) {
+    let x = seed >>> 0 || 1;
+    return () => {
+        x ^= x << 13; x >>>= 0;
+        x ^= x >>> 17;
+        x ^= x << 5; x >>>= 0;
+        return x / 0x100000000;
+    };
+}
+
+class Simulation {
+    constructor() {
+        this.now = 0;           // ms since the start
+        this.heap = [];
+        this.seq = 0;
+        this.serverNs = { campaign: 0n, fragmenter: 0n };
+    }
+
+    at(time, fn) {
+        let ev = { time: Math.max(time, this.now), seq: this.seq++, fn: fn, cancelled: false };
+        let heap = this.heap;
+        heap.push(ev);
+        for (let ix = heap.length - 1; ix > 0; ) {
+            let parent = (ix - 1) >> 1;
+            if (this._before(heap[parent], heap[ix])) break;
+            [ heap[parent], heap[ix] ] = [ heap[ix], heap[parent] ];
+            ix = parent;
+        }
+        return ev;
+    }
+
+    in(ms, fn) {
+        return this.at(this.now + ms, fn);
+    }
+
+    _before(a, b) {
+        return a.time < b.time || (a.time === b.time && a.seq < b.seq);
+    }
+
+    _pop() {
+        let heap = this.heap;
+        let top = heap[0];
+        let last = heap.pop();
+        if (heap.length > 0) {
+            heap[0] = last;
+            for (let ix = 0; ; ) {
+                let l = 2 * ix + 1, r = l + 1, min = ix;
+                if (l < heap.length && this._before(heap[l], heap[min])) min = l;
+                if (r < heap.length && this._before(heap[r], heap[min])) min = r;
+                if (min === ix) break;
+                [ heap[min], heap[ix] ] = [ heap[ix], heap[min] ];
+                ix = min;
+            }
+        }
+        return top;
+    }
+
+    run(untilMs, stop) {
+        while (this.heap.length > 0 && !stop()) {
+            let ev = this._pop();
+            if (ev.time > untilMs) break;
+            this.now = ev.time;
+            if (!ev.cancelled) ev.fn();
+        }
+    }
+
+    // time spent in the server, so the simulated devices don't count
+    server(fn, part) {
+        let start = process.hrtime.bigint();
+        try {
+            return fn();
+        }
+        finally {
+            this.serverNs[part || 'campaign'] += process.hrtime.bigint() - start;
+        }
+    }
+
+    gpsNow() {
+        return GPS_EPOCH_S + Math.floor(this.now / 1000);
+    }
+}
+
+/**
+ * Stand-in for the MQTT broker: same topics, messages are delivered after the network latency
+ */
+class Broker {
+    constructor(sim, latencyMs, rand) {
+        this.sim = sim;
+        this.latencyMs = latencyMs;
+        this.rand = rand;
+        this.exact = new Map();     // topic -> handlers, one lookup per message for the per-device topics
+        this.wildcards = [];
+        this.published = 0;
+    }
+
+    subscribe(pattern, fn) {
+        if (/[#+]/.test(pattern)) {
+            let re = new RegExp('^' + pattern.replace(/[.]/g, '\\.').replace(/\+/g, '[^/]+').replace(/#$/, '.*') + '$');
+            this.wildcards.push({ re: re, fn: fn });
+            return;
+        }
+        if (!this.exact.has(pattern)) this.exact.set(pattern, []);
+        this.exact.get(pattern).push(fn);
+    }
+
+    publish(topic, payload) {
+        this.published++;
+        let delay = this.latencyMs * (0.5 + this.rand());
+        this.sim.in(delay, () => {
+            for (let fn of this.exact.get(topic) || []) fn(topic, payload);
+            for (let w of this.wildcards) {
+                if (w.re.test(topic)) w.fn(topic, payload);
+            }
+        });
+    }
+}
+
+// --- simulated device ---
+
+function u32(b, ix) {
+    return (b[ix] | (b[ix + 1] << 8) | (b[ix + 2] << 16) | (b[ix + 3] << 24)) >>> 0;
+}
+
+class SimDevice {
+    constructor(sim, broker, eui, opts, rand, stats) {
+        this.sim = sim;
+        this.broker = broker;
+        this.eui = eui;
+        this.opts = opts;
+        this.rand = rand;
+        this.stats = stats;
+
+        this.clockOffsetS = (rand() * 2 - 1) * opts['clock-offset'];
+        this.drift = (rand() * 2 - 1) * opts['drift-ppm'] / 1e6;
+        this.fragmentLoss = Math.min(rand() * 2 * opts['fragment-loss'], 1);
+
+        this.synced = false;
+        this.queue = [];            // answers, the same port and command replaces a waiting one (like UplinkQueue)
+        this.uplinkTimer = null;
+        this.firstUplinkAt = null;
+
+        this.mcGroupId = null;
+        this.classC = null;         // { sessionTime, startAt, endAt, listening }
+        this.frag = null;           // { index, nbFrag, data: Set, parity, complete }
+
+        broker.subscribe(`application/${MC_APPLICATION_ID}/device/${eui}/tx`, (topic, payload) => this._onDownlink(payload));
+    }
+
+    start() {
+        this._scheduleUplink(this.rand() * this.opts['join-spread'] * 1000);
+    }
+
+    // GPS time on the device's clock
+    clock() {
+        return Math.floor(GPS_EPOCH_S + this.sim.now / 1000 * (1 + this.drift) + this.clockOffsetS);
+    }
+
+    // when the device's clock reaches a GPS time
+    trueTimeOf(gps) {
+        return (gps - GPS_EPOCH_S - this.clockOffsetS) / (1 + this.drift) * 1000;
+    }
+
+    inClassC() {
+        return this.classC !== null && this.classC.listening;
+    }
+
+    _scheduleUplink(ms) {
+        if (this.uplinkTimer) this.uplinkTimer.cancelled = true;
+        this.uplinkTimer = this.sim.in(ms, () => {
+            this.uplinkTimer = null;
+            this._uplink();
+        });
+    }
+
+    _queue(port, data) {
+        let existing = this.queue.findIndex(q => q.port === port && q.data[0] === data[0]);
+        if (existing !== -1) this.queue[existing] = { port: port, data: data };
+        else this.queue.push({ port: port, data: data });
+    }
+
+    _uplink() {
+        // no uplinks while listening to the multicast session, the queue is sent after
+        if (this.inClassC()) {
+            return this._scheduleUplink(Math.max(this.classC.endAt - this.sim.now, 0) + 1000);
+        }
+
+        if (this.firstUplinkAt === null) this.firstUplinkAt = this.sim.now;
+
+        let port, data;
+        let ix = this.queue.findIndex(q => q.port === 202 || (q.port === 200 && q.data[0] === 0x04) || (q.port === 201 && q.data[0] === 0x01));
+        if (ix === -1 && this.queue.length > 0) ix = 0;
+
+        if (ix !== -1) {
+            let q = this.queue.splice(ix, 1)[0];
+            port = q.port;
+            data = q.data;
+
+            // McClassCSessionAns: time to start is calculated when it's sent (updateClassCSessionAns)
+            if (port === 200 && data[0] === 0x04 && this.classC) {
+                let tts = Math.max(this.classC.sessionTime - this.clock(), 0);
+                data = [ 0x04, data[1], tts & 0xff, (tts >> 8) & 0xff, (tts >> 16) & 0xff ];
+            }
+        }
+        else if (!this.synced) {
+            let t = this.clock();
+            port = 202;
+            data = [ 0x01, t & 0xff, (t >> 8) & 0xff, (t >> 16) & 0xff, (t >>> 24) & 0xff, 0x10 /* AnsRequired */ ];
+        }
+        else {
+            port = 15;
+            data = [ 0, 0, 0, 0 ];
+        }
+
+        this.stats.uplinks++;
+        this.broker.publish(`application/${MC_APPLICATION_ID}/device/${this.eui}/rx`, JSON.stringify({
+            applicationID: MC_APPLICATION_ID,
+            devEUI: this.eui,
+            fPort: port,
+            data: Buffer.from(data).toString('base64'),
+        }));
+
+        let interval = this.opts['uplink-interval'] * 1000 * (0.5 + this.rand());
+        let answer = this.opts['answer-delay'] * 1000 * (0.5 + this.rand());
+        this._scheduleUplink(this.queue.length > 0 || !this.synced ? answer : interval);
+    }
+
+    _onDownlink(payload) {
+        if (this.inClassC()) return;            // Class C runs on the multicast session
+        if (this.rand() < this.opts['downlink-loss']) {
+            this.stats.downlinksLost++;
+            return;
+        }
+
+        let msg = JSON.parse(payload);
+        let b = Buffer.from(msg.data, 'base64');
+        let hadAnswer = this.queue.length;
+
+        if (msg.fPort === 202 && b[0] === 0x01) {               // AppTimeAns
+            let correction = b[1] | (b[2] << 8) | (b[3] << 16) | (b[4] << 24);
+            this.clockOffsetS += correction;
+            this.synced = true;
+        }
+        else if (msg.fPort === 200 && b[0] === 0x02) {          // McGroupSetupReq
+            this.mcGroupId = b[1] & 0x3;
+            this._queue(200, [ 0x02, this.mcGroupId ]);
+        }
+        else if (msg.fPort === 200 && b[0] === 0x04) {          // McClassCSessionReq
+            this._classCSessionReq(b);
+        }
+        else if (msg.fPort === 201 && b[0] === 0x02) {          // FragSessionSetupReq
+            let index = (b[1] >> 4) & 0x3;
+            this.frag = { index: index, nbFrag: b[2] | (b[3] << 8), data: new Set(), parity: 0, complete: false };
+            this._queue(201, [ 0x02, index << 6 ]);
+        }
+        else if (msg.fPort === 201 && b[0] === 0x01) {          // FragSessionStatusReq
+            if (this.frag) this._queueStatus();
+        }
+
+        if (this.queue.length > hadAnswer) {
+            this._scheduleUplink(this.opts['answer-delay'] * 1000 * (0.5 + this.rand()));
+        }
+    }
+
+    _classCSessionReq(b) {
+        let group = b[1] & 0x3;
+        let sessionTime = u32(b, 2);
+        let windowMs = Math.pow(2, b[6] & 0xf) * 1000;
+
+        if (this.classC && this.classC.listening) return;
+        let startAt = this.trueTimeOf(sessionTime);
+
+        this.classC = { sessionTime: sessionTime, startAt: startAt, endAt: startAt + windowMs, listening: false };
+        this._queue(200, [ 0x04, group, 0, 0, 0 ]);
+
+        let session = this.classC;
+        this.sim.at(startAt, () => {
+            if (this.classC !== session) return;
+            session.listening = true;
+            this.stats.onClassCStart(this, this.sim.now);
+        });
+        this.sim.at(startAt + windowMs, () => this._leaveClassC(session));
+    }
+
+    _leaveClassC(session) {
+        if (this.classC !== session || !session.listening) return;
+        session.listening = false;
+        session.endAt = this.sim.now;
+        this._scheduleUplink(this.opts['answer-delay'] * 1000 * (0.5 + this.rand()));
+    }
+
+    onFragment(n) {
+        if (!this.frag || this.frag.complete || this.rand() < this.fragmentLoss) return;
+
+        if (n <= this.frag.nbFrag) this.frag.data.add(n);
+        else this.frag.parity++;
+
+        if (this._missing() === 0) {
+            this.frag.complete = true;
+            this.stats.completed++;
+            this._queueStatus();
+            // class-c-early-exit
+            this._leaveClassC(this.classC);
+        }
+    }
+
+    // fragments needed before the session can be decoded
+    _missing() {
+        let lost = this.frag.nbFrag - this.frag.data.size;
+        if (lost === 0) return 0;
+        let needed = lost + Math.ceil(lost * this.opts['decode-overhead']);
+        return Math.max(needed - this.frag.parity, 0);
+    }
+
+    _queueStatus() {
+        let received = Math.min(this.frag.data.size + this.frag.parity, 0x3fff);
+        let missing = this.frag.complete ? 0 : Math.min(Math.max(this._missing(), 1), 255);
+        this._queue(201, [ 0x01, received & 0xff, ((received >> 8) & 0x3f) | (this.frag.index << 6), missing, 0 ]);
+    }
+}
+
+// --- statistics ---
+
+function percentile(values, p) {
+    if (values.length === 0) return NaN;
+    let sorted = values.slice().sort((a, b) => a - b);
+    return sorted[Math.min(Math.ceil(p / 100 * sorted.length) - 1, sorted.length - 1)];
+}
+
+function row(label, values, digits) {
+    if (values.length === 0) return `  ${label.padEnd(22)} -`;
+    let f = v => v.toFixed(digits).padStart(9);
+    return `  ${label.padEnd(22)}${String(values.length).padStart(7)}${f(Math.min.apply(null, values))}${f(percentile(values, 50))}` +
+        `${f(percentile(values, 90))}${f(percentile(values, 99))}${f(Math.max.apply(null, values))}`;
+}
+
+function parseArgs(argv) {
+    let opts = Object.assign({}, OPTIONS);
+    for (let ix = 0; ix < argv.length; ix++) {
+        let name = argv[ix].replace(/^--/, '');
+        if (!(name in OPTIONS)) throw new Error('Unknown option ' + argv[ix]);
+        if (typeof OPTIONS[name] === 'boolean') opts[name] = true;
+        else opts[name] = Number(argv[++ix]);
+    }
+    return opts;
+}
+
+function simulate(opts) {
+    let rand = prng(opts.seed);
+    let sim = new Simulation();
+    let broker = new Broker(sim, opts['network-latency'] * 1000, rand);
+
+    let log = console.log;
+    if (!opts.verbose) console.log = console.warn = () => {};
+
+    let stats = {
+        uplinks: 0,
+        downlinksLost: 0,
+        completed: 0,
+        classCStarts: [],
+        onClassCStart: (dev, at) => {
+            // devices that got the McClassCSessionReq too late are missed by the campaign, they don't count
+            if (campaign.devices.get(dev.eui).phase !== Campaign.PHASE.READY) return;
+            stats.classCStarts.push((at - (campaign.startTime - GPS_EPOCH_S) * 1000) / 1000);
+        },
+    };
+
+    let devices = new Map();
+    for (let ix = 0; ix < opts.devices; ix++) {
+        let eui = (0x0080000000000000n + BigInt(ix)).toString(16).padStart(16, '0');
+        devices.set(eui, new SimDevice(sim, broker, eui, opts, rand, stats));
+    }
+
+    if (global.gc) global.gc();
+    let heapBefore = process.memoryUsage().heapUsed;
+    let heapPeak = heapBefore;
+
+    // the update file, fragmented like loraserver.js does
+    let file = Buffer.alloc(opts['file-size']);
+    for (let ix = 0; ix < file.length; ix++) file[ix] = rand() * 256 | 0;
+    let fragmenter = new Fragmenter(file, { fragSize: Fragmenter.maxFragSize(opts.dr) });
+    fragmenter.redundancy = Math.ceil(fragmenter.nbFrag * opts.redundancy);
+
+    // generating fragments counts as fragmenter time
+    let fragmenterPackets = fragmenter.packets.bind(fragmenter);
+    let fragmenterParity = fragmenter.nextParityPacket.bind(fragmenter);
+    fragmenter.packets = () => {
+        let it = fragmenterPackets();
+        return { next: () => sim.server(() => it.next(), 'fragmenter') };
+    };
+    fragmenter.nextParityPacket = () => sim.server(fragmenterParity, 'fragmenter');
+
+    let senderOpts = {
+        datarate: opts.dr,
+        dutyCycle: opts['gw-duty-cycle'],
+        schedulerIntervalMs: opts['ns-scheduler-interval-ms'],
+        fragmenter: fragmenter,
+        now: () => sim.now,
+        timers: { setTimeout: (fn, ms) => sim.in(ms, fn) },
+        publish: msg => {
+            sent++;
+            broker.publish(`application/${MC_APPLICATION_ID}/device/${MC_DEV_EUI}/tx`, JSON.stringify(msg));
+        },
+    };
+
+    // the Class C window has to cover the first pass, SessionTimeOut is 2^n seconds
+    let pacing = classCSender.pacing(fragmenter.fragSize + 3, senderOpts);
+    let passS = (fragmenter.nbFrag + fragmenter.redundancy) * pacing.intervalMs / 1000 + 30;
+    let sessionTimeout = Math.min(Math.ceil(Math.log2(passS)), 15);
+
+    let campaign = sim.server(() => new Campaign({
+        devices: Array.from(devices.keys()),
+        fragSessionSetup: fragmenter.setupRequest(),
+        datarate: opts.dr,
+        completionTarget: opts['completion-target'],
+        classCWaitS: opts['class-c-wait'],
+        sessionTimeout: sessionTimeout,
+        now: () => sim.gpsNow(),
+        timers: {
+            setTimeout: (fn, ms) => sim.in(ms, () => sim.server(fn)),
+            clearTimeout: ev => { if (ev) ev.cancelled = true; },
+        },
+        publish: (devEUI, applicationID, msg) => {
+            broker.publish(`application/${applicationID}/device/${devEUI}/tx`, JSON.stringify(msg));
+        },
+    }));
+
+    // like loraserver.js: everything the network server reports goes into the campaign
+    broker.subscribe('application/#', (topic, payload) => {
+        if (!/\/rx$/.test(topic)) return;
+        sim.server(() => campaign.handleUplink(JSON.parse(payload)));
+    });
+
+    // the multicast device reaches every device that listens to the Class C session
+    broker.subscribe(`application/${MC_APPLICATION_ID}/device/${MC_DEV_EUI}/tx`, (topic, payload) => {
+        let b = Buffer.from(JSON.parse(payload).data, 'base64');
+        let n = b[1] | ((b[2] & 0x3f) << 8);
+        for (let dev of devices.values()) {
+            if (dev.inClassC()) dev.onFragment(n);
+        }
+    });
+
+    let phaseAt = {};
+    campaign.on('phase', (eui, phase) => {
+        let dev = devices.get(eui);
+        if (!phaseAt[phase]) phaseAt[phase] = new Map();
+        if (!phaseAt[phase].has(eui) && dev.firstUplinkAt !== null) {
+            phaseAt[phase].set(eui, (sim.now - dev.firstUplinkAt) / 1000);
+        }
+    });
+
+    let ended = false;
+    let sent = 0;
+    let rounds = [];
+    let startDeltas = [];
+
+    campaign.on('done', () => ended = true);
+    campaign.on('repairs-exhausted', () => ended = true);
+
+    // passDone() is called by the sender, and counts as campaign time
+    let passDone = campaign.passDone.bind(campaign);
+    campaign.passDone = counter => sim.server(() => passDone(counter));
+
+    // like startSendingClassCPackets() in loraserver.js
+    campaign.on('classc', (ready) => {
+        startDeltas = startDeltas.concat(stats.classCStarts);
+        stats.classCStarts = [];
+
+        let pass = classCSender.send(campaign, senderOpts);
+        rounds.push({ round: campaign.repairRound, devices: ready.length, fragments: pass.packetCount });
+    });
+
+    let sampleHeap = () => {
+        heapPeak = Math.max(heapPeak, process.memoryUsage().heapUsed);
+        if (!ended) sim.in(60000, sampleHeap);
+    };
+    sampleHeap();
+
+    let wallStart = Date.now();
+    for (let dev of devices.values()) dev.start();
+    sim.run(opts['max-hours'] * 3600 * 1000, () => ended);
+    let wallS = (Date.now() - wallStart) / 1000;
+
+    // devices that only report back after the last pass
+    sim.run(sim.now + 3600 * 1000, () => false);
+
+    console.log = log;
+
+    let summary = campaign.summary();
+    let serverMs = Number(sim.serverNs.campaign) / 1e6;
+    let fragmenterMs = Number(sim.serverNs.fragmenter) / 1e6;
+
+    console.log(`Fleet simulation: ${opts.devices} devices, ${fragmenter.nbFrag} fragments of ${fragmenter.fragSize} bytes at DR${opts.dr},` +
+        ` downlink loss ${opts['downlink-loss']}, fragment loss 0..${(opts['fragment-loss'] * 2).toFixed(2)}`);
+    console.log(`Simulated ${(sim.now / 3600000).toFixed(2)} hours in ${wallS.toFixed(1)} s, Class C window 2^${sessionTimeout} s,` +
+        ` ${pacing.intervalMs} ms per fragment`);
+    console.log('');
+    console.log('Setup latency (s since first uplink)     n      min      p50      p90      p99      max');
+    for (let phase of [ Campaign.PHASE.MC_SETUP, Campaign.PHASE.FRAG_SETUP, Campaign.PHASE.WAITING, Campaign.PHASE.READY ]) {
+        console.log(row(phase, Array.from((phaseAt[phase] || new Map()).values()), 1));
+    }
+    console.log('');
+    console.log('Class C start delta (s)                  n      min      p50      p90      p99      max');
+    console.log(row('device vs. server', startDeltas.concat(stats.classCStarts), 2));
+    console.log('');
+    for (let r of rounds) {
+        console.log(`  ${r.round === 0 ? 'first pass' : 'repair round ' + r.round}: ${r.fragments} fragments for ${r.devices} devices`);
+    }
+    console.log(`Completion: ${summary.complete} of ${opts.devices} devices (${(summary.complete / opts.devices * 100).toFixed(1)}%),` +
+        ` ${summary.failed} failed, ${summary.missed} missed, ${sent} fragments sent`);
+    console.log('');
+    console.log(`Server: ${serverMs.toFixed(0)} ms CPU in the campaign for ${stats.uplinks} uplinks` +
+        ` (${(serverMs * 1000 / Math.max(stats.uplinks, 1)).toFixed(1)} us per uplink), ${fragmenterMs.toFixed(0)} ms generating ${sent} fragments,` +
+        ` ${broker.published} messages published`);
+    console.log(`Heap: ${(heapPeak / 1048576).toFixed(1)} MB peak, ${((heapPeak - heapBefore) / 1048576).toFixed(1)} MB more than before the campaign was created (includes messages in flight)` +
+        (global.gc ? '' : ' (run with --expose-gc for a cleaner baseline)'));
+
+    return { summary: summary, serverMs: serverMs, fragmenterMs: fragmenterMs, heapPeak: heapPeak };
+}
+
+module.exports = {
+    simulate: simulate,
+    OPTIONS: OPTIONS,
+};
+
+if (require.main === module) {
+    simulate(parseArgs(process.argv.slice(2)));
+}
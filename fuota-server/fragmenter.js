@@ -0,0 +1,170 @@
+/**
+ * Fragments an update file and generates FEC parity on the fly
+ *
+ * Implements the fragmentation and the parity matrix (prbs23 based) from LoRaWAN Fragmented Data Block Transport v1.0.0,
+ * the same coding that the update client decodes. Packets are generated when they're sent, so the frag size and the
+ * redundancy can be picked per campaign, and more parity can be sent later on.
+ */
+
+const fs = require('fs');
+
+const FRAG_SESSION_SETUP_REQ = 0x02;
+const DATA_FRAGMENT = 0x08;
+const DATA_FRAGMENT_HEADER_LENGTH = 3;
+
+// fragment index N is 14 bits
+const MAX_FRAGMENT_INDEX = 0x3fff;
+
+// EU868 maximum application payload per data rate (without FOpts)
+const MAX_PAYLOAD = [ 51, 51, 51, 115, 242, 242, 242 ];
+
+function prbs23(x) {
+    let b0 = x & 1;
+    let b1 = (x & 32) >> 5;
+    return (x >>> 1) + ((b0 ^ b1) << 22);
+}
+
+function isPowerOfTwo(x) {
+    return x > 0 && (x & (x - 1)) === 0;
+}
+
+/**
+ * Parity matrix row for parity fragment n (1 based), for m data fragments
+ *
+ * @returns {Uint8Array} m entries, 1 if the data fragment is part of the parity fragment
+ */
+function matrixLine(n, m) {
+    let line = new Uint8Array(m);
+    let mTemp = isPowerOfTwo(m) ? 1 : 0;
+    let x = 1 + 1001 * n;
+    let nbCoeff = 0;
+
+    while (nbCoeff < (m >> 1)) {
+        let r = 1 << 16;
+        while (r >= m) {
+            x = prbs23(x);
+            r = x % (m + mTemp);
+        }
+        line[r] = 1;
+        nbCoeff++;
+    }
+
+    return line;
+}
+
+class Fragmenter {
+    /**
+     * @param {Buffer} file - update file (firmware, signature and manifest)
+     * @param {Object} opts
+     * @param {number} opts.fragSize - size of a fragment, without the 3 byte header
+     * @param {number} opts.redundancy - number of parity fragments that packets() generates
+     * @param {number} [opts.fragIndex] - fragmentation session index (0..3)
+     * @param {number} [opts.mcGroupBitMask] - multicast groups that the session is for
+     * @param {number} [opts.descriptor] - file descriptor in the FragSessionSetupReq
+     */
+    constructor(file, opts) {
+        this.file = file;
+        this.fragSize = opts.fragSize;
+        this.redundancy = opts.redundancy || 0;
+        this.fragIndex = opts.fragIndex || 0;
+        this.mcGroupBitMask = opts.mcGroupBitMask || 0;
+        this.descriptor = opts.descriptor || 0;
+
+        if (!(this.fragSize > 0 && this.fragSize <= 255 - DATA_FRAGMENT_HEADER_LENGTH)) {
+            throw new Error('Invalid frag size ' + this.fragSize);
+        }
+
+        this.nbFrag = Math.ceil(file.length / this.fragSize);
+        this.padding = this.nbFrag * this.fragSize - file.length;
+
+        if (this.nbFrag + this.redundancy > MAX_FRAGMENT_INDEX) {
+            throw new Error('Too many fragments (' + this.nbFrag + ' + ' + this.redundancy + '), increase the frag size');
+        }
+
+        this.nextParity = 1;
+    }
+
+    static fromFile(path, opts) {
+        return new Fragmenter(fs.readFileSync(path), opts);
+    }
+
+    /**
+     * Largest frag size that fits in a downlink at an EU868 data rate
+     */
+    static maxFragSize(datarate) {
+        return MAX_PAYLOAD[datarate] - DATA_FRAGMENT_HEADER_LENGTH;
+    }
+
+    setupRequest() {
+        return [
+            FRAG_SESSION_SETUP_REQ,
+            (this.fragIndex << 4) | (this.mcGroupBitMask & 0xf),
+            this.nbFrag & 0xff, (this.nbFrag >> 8) & 0xff,
+            this.fragSize,
+            0, // control: fragmentation matrix 0, block ack delay 0
+            this.padding,
+            this.descriptor & 0xff, (this.descriptor >> 8) & 0xff, (this.descriptor >> 16) & 0xff, (this.descriptor >>> 24) & 0xff
+        ];
+    }
+
+    /**
+     * Data fragment or parity fragment n (1 based, n > nbFrag is parity)
+     *
+     * @returns {Buffer} DataFragment packet (FPort 201)
+     */
+    packet(n) {
+        let packet = Buffer.alloc(DATA_FRAGMENT_HEADER_LENGTH + this.fragSize);
+        packet[0] = DATA_FRAGMENT;
+        packet[1] = n & 0xff;
+        packet[2] = ((n >> 8) & 0x3f) | (this.fragIndex << 6);
+
+        let data = packet.slice(DATA_FRAGMENT_HEADER_LENGTH);
+
+        if (n <= this.nbFrag) {
+            this.file.copy(data, 0, (n - 1) * this.fragSize, n * this.fragSize);
+            return packet;
+        }
+
+        let line = matrixLine(n - this.nbFrag, this.nbFrag);
+        for (let ix = 0; ix < this.nbFrag; ix++) {
+            if (!line[ix]) continue;
+
+            let start = ix * this.fragSize;
+            let end = Math.min(start + this.fragSize, this.file.length);
+            for (let b = start; b < end; b++) {
+                data[b - start] ^= this.file[b];
+            }
+        }
+
+        return packet;
+    }
+
+    /**
+     * All data fragments, followed by the configured number of parity fragments
+     */
+    *packets() {
+        for (let n = 1; n <= this.nbFrag; n++) {
+            yield this.packet(n);
+        }
+        for (let ix = 0; ix < this.redundancy; ix++) {
+            yield this.nextParityPacket();
+        }
+    }
+
+    /**
+     * Parity fragment that was not sent before, e.g. to repair losses that devices reported
+     *
+     * @returns {Buffer|null} null if the fragment index space is used up
+     */
+    nextParityPacket() {
+        let n = this.nbFrag + this.nextParity;
+        if (n > MAX_FRAGMENT_INDEX) return null;
+
+        this.nextParity++;
+        return this.packet(n);
+    }
+}
+
+Fragmenter.matrixLine = matrixLine;
+
+module.exports = Fragmenter;
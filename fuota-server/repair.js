@@ -0,0 +1,86 @@
+/**
+ * Picks the number of parity fragments for a repair round, from the FragSessionStatusAns messages of a sample of devices
+ *
+ * Every device in the sample tells how many fragments it still misses. Its loss rate is what it did not receive of what
+ * was sent while it was listening, since its previous status if it had one (a device that missed a session did not
+ * lose those), and it needs enough parity that, at that loss rate, it receives the missing fragments (plus a small
+ * decoding overhead) with high confidence. The round is sized for the worst device in the sample, from what it misses
+ * now. A device that was not in any session yet misses all data fragments, and gets the highest loss rate of the sample.
+ */
+
+// one-sided 90% confidence
+const Z_90 = 1.2816;
+
+const DEFAULTS = {
+    confidenceZ: Z_90,          // per device, the chance of receiving enough parity
+    decodeOverhead: 0.05,       // parity fragments needed on top of the missing fragments (share of missing)
+    decodeOverheadMin: 2,       // and at least this many
+    minLossRate: 0.01,
+    maxLossRate: 0.9,
+    unknownLossRate: 0.2,       // for devices that were not in a session yet, if no device in the sample was either
+    maxParity: 0x3fff,
+    nbFrag: 0,                  // data fragments in the session, for devices that miss more than MissingFrag can hold
+};
+
+// MissingFrag in FragSessionStatusAns is one byte
+const MISSING_FRAG_MAX = 255;
+
+/**
+ * Parity fragments that a device needs, so that it receives at least `needed` of them with confidence z,
+ * when it loses `lossRate` of the fragments (normal approximation of the binomial distribution)
+ */
+function parityForDevice(needed, lossRate, z, maxParity) {
+    if (needed <= 0) return 0;
+
+    let p = 1 - lossRate;
+    for (let n = needed; n <= maxParity; n++) {
+        if (n * p - z * Math.sqrt(n * p * lossRate) >= needed) return n;
+    }
+    return maxParity;
+}
+
+/**
+ * @param {Object[]} statuses - { received, missing, sent, [passReceived, passSent] } per sampled device (missing 0 if the
+ *                               device is complete, sent: fragments sent while the device was listening, pass*: the
+ *                               same since its previous status)
+ * @param {Object} [opts] - see DEFAULTS
+ * @returns {Object} parity: fragments to send in the repair round, perDevice: what every sampled device needs
+ */
+function repairParity(statuses, opts) {
+    opts = Object.assign({}, DEFAULTS, opts);
+
+    let clamp = lossRate => Math.min(Math.max(lossRate, opts.minLossRate), opts.maxLossRate);
+
+    // a complete device stops listening, so only devices that still miss fragments tell their loss rate
+    let lossRates = statuses.map(s => {
+        if (s.missing === 0) return null;
+
+        let sent = s.passSent !== undefined ? s.passSent : s.sent;
+        let received = s.passReceived !== undefined ? s.passReceived : s.received;
+        return sent > 0 ? clamp(1 - received / sent) : null;
+    });
+    let known = lossRates.filter(l => l !== null);
+    let worstLossRate = known.length > 0 ? Math.max.apply(null, known) : opts.unknownLossRate;
+
+    let perDevice = statuses.map((s, ix) => {
+        if (s.missing === 0) return 0;
+
+        let missing = s.missing;
+        if (missing >= MISSING_FRAG_MAX && opts.nbFrag > s.received) {
+            missing = Math.max(missing, opts.nbFrag - s.received);
+        }
+
+        let lossRate = lossRates[ix] !== null ? lossRates[ix] : worstLossRate;
+        let needed = missing + Math.max(Math.ceil(missing * opts.decodeOverhead), opts.decodeOverheadMin);
+        return parityForDevice(needed, lossRate, opts.confidenceZ, opts.maxParity);
+    }).sort((a, b) => a - b);
+
+    if (perDevice.length === 0) return { parity: 0, perDevice: perDevice };
+
+    return { parity: perDevice[perDevice.length - 1], perDevice: perDevice };
+}
+
+module.exports = {
+    parityForDevice: parityForDevice,
+    repairParity: repairParity,
+};
@@ -0,0 +1,30 @@
+/**
+ * Decodes the RX latency stats uplink (rx-latency-uplink-port, see source/helpers/rx_latency_helper.h)
+ */
+
+const STAGES = [ 'receive', 'fec', 'flash', 'total' ];
+
+/**
+ * @param {Buffer} body - uplink payload
+ * @returns {Object|null} per stage: count, p50Us and p99Us (upper bound of the histogram bucket), maxMs
+ */
+function decode(body) {
+    if (body.length !== 1 + STAGES.length * 6 || body[0] !== 1) return null;
+
+    let stats = {};
+    STAGES.forEach((stage, ix) => {
+        let o = 1 + ix * 6;
+        let count = body.readUInt16LE(o);
+        stats[stage] = {
+            count: count,
+            p50Us: count ? Math.pow(2, body[o + 2] + 1) - 1 : 0,
+            p99Us: count ? Math.pow(2, body[o + 3] + 1) - 1 : 0,
+            maxMs: body.readUInt16LE(o + 4) / 10,
+        };
+    });
+    return stats;
+}
+
+module.exports = {
+    decode: decode,
+};
@@ -0,0 +1,121 @@
+/**
+ * Tests for repair.js, run with `npm test`
+ *
+ * Runs repair rounds against a fleet of devices with different loss rates (without the campaign and the simulator
+ * around it), and checks that every round is sized for the worst sampled device and that the rounds get smaller.
+ */
+
+const assert = require('assert');
+const repair = require('./repair');
+
+// xorshift32, so every run is the same
+function prng(seed) {
+    let x = seed >>> 0 || 1;
+    return () => {
+        x ^= x << 13; x >>>= 0;
+        x ^= x >>> 17;
+        x ^= x << 5; x >>>= 0;
+        return x / 0x100000000;
+    };
+}
+
+const NB_FRAG = 200;
+const SAMPLE = 10;
+
+// a device needs NB_FRAG fragments (data or parity) to decode, and reports like FragSessionStatusAns
+function device(lossRate) {
+    return { lossRate: lossRate, received: 0, sent: 0, reported: null };
+}
+
+function listen(dev, fragments, rand) {
+    for (let ix = 0; ix < fragments; ix++) {
+        if (rand() >= dev.lossRate) dev.received++;
+    }
+    dev.sent += fragments;
+}
+
+function status(dev) {
+    let s = { received: dev.received, missing: Math.max(NB_FRAG - dev.received, 0), sent: dev.sent };
+    if (dev.reported && dev.sent > dev.reported.sent) {
+        s.passReceived = dev.received - dev.reported.received;
+        s.passSent = dev.sent - dev.reported.sent;
+    }
+    dev.reported = { received: dev.received, sent: dev.sent };
+    return s;
+}
+
+function repairRounds(seed) {
+    let rand = prng(seed);
+    let fleet = [];
+    for (let ix = 0; ix < 500; ix++) {
+        fleet.push(device(rand() * 0.3));
+    }
+
+    // first pass with 5% parity
+    fleet.forEach(dev => listen(dev, NB_FRAG + 10, rand));
+
+    let rounds = [];
+    for (let round = 1; round <= 5; round++) {
+        let incomplete = fleet.filter(dev => dev.received < NB_FRAG);
+        if (incomplete.length === 0) break;
+
+        // like the campaign, only a sample of the incomplete devices is asked for its status
+        let sample = incomplete.slice();
+        for (let ix = sample.length - 1; ix > 0; ix--) {
+            let j = rand() * (ix + 1) | 0;
+            [ sample[ix], sample[j] ] = [ sample[j], sample[ix] ];
+        }
+        let statuses = sample.slice(0, SAMPLE).map(status);
+        let result = repair.repairParity(statuses, { nbFrag: NB_FRAG });
+
+        assert.strictEqual(result.parity, Math.max.apply(null, result.perDevice), 'round is sized for the worst sampled device');
+        rounds.push(result.parity);
+
+        incomplete.forEach(dev => listen(dev, result.parity, rand));
+    }
+
+    return rounds;
+}
+
+function testRoundsShrink() {
+    let multiple = 0;
+    for (let seed = 1; seed <= 20; seed++) {
+        let rounds = repairRounds(seed);
+        for (let ix = 1; ix < rounds.length; ix++) {
+            assert.ok(rounds[ix] < rounds[ix - 1], 'repair rounds shrink (seed ' + seed + '): ' + rounds.join(', '));
+        }
+        if (rounds.length > 1) multiple++;
+    }
+    // with a sample, the worst device is not always asked, so some fleets need another round
+    assert.ok(multiple > 0, 'no fleet needed more than one repair round');
+    console.log('ok - repair rounds shrink,', multiple, 'of 20 fleets needed more than one round');
+}
+
+function testLossRateSincePreviousStatus() {
+    // lost half in the first pass, nothing since: sized from the last pass, not from everything it was sent
+    let s = { received: 190, missing: 10, sent: 300, passReceived: 100, passSent: 100 };
+    let result = repair.repairParity([ s ], { nbFrag: 200 });
+    assert.strictEqual(result.parity, repair.parityForDevice(12, 0.01, 1.2816, 0x3fff));
+    console.log('ok - loss rate since the previous status');
+}
+
+function testDeviceThatWasNotInASession() {
+    let statuses = [
+        { received: 180, missing: 20, sent: 200 },     // loses 10%
+        { received: 0, missing: 200, sent: 0 },        // not in a session yet
+    ];
+    let result = repair.repairParity(statuses, { nbFrag: 200 });
+    assert.strictEqual(result.parity, repair.parityForDevice(210, 0.1, 1.2816, 0x3fff));
+    console.log('ok - a device that was not in a session misses everything, at the worst loss rate of the sample');
+}
+
+function testCompleteDevicesNeedNothing() {
+    let result = repair.repairParity([ { received: 80, missing: 0, sent: 300 } ], { nbFrag: 200 });
+    assert.strictEqual(result.parity, 0);
+    console.log('ok - complete devices need no parity');
+}
+
+testRoundsShrink();
+testLossRateSincePreviousStatus();
+testDeviceThatWasNotInASession();
+testCompleteDevicesNeedNothing();
@@ -28,8 +28,29 @@
 #define MBEDTLS_ECP_DP_SECP256R1_ENABLED
 #define MBEDTLS_ECDSA_DETERMINISTIC
 #define MBEDTLS_NO_PLATFORM_ENTROPY
+
+/*
+ * Crypto profile (crypto-profile in mbed_app.json)
+ *
+ * 0 - small: for targets with little RAM (e.g. the FF1705). Quarter size AES tables. The ECP window, the
+ *     fixed-point optimization and SHA256 keep the mbedTLS defaults, so ECDSA verify and hashing the slot
+ *     are as fast as before the profiles existed.
+ * 1 - fast: for targets with spare RAM (e.g. the DISCO_L475VG). Full AES tables and fast NIST reduction.
+ *     Everything else is the mbedTLS default as well (ECP window of 6, fixed-point optimization on).
+ *
+ * Hardware accelerators (the _ALT implementations) are enabled by platform_mbed.h for targets that define
+ * MBEDTLS_CONFIG_HW_SUPPORT, in both profiles.
+ */
+#if defined(MBED_CONF_APP_CRYPTO_PROFILE) && MBED_CONF_APP_CRYPTO_PROFILE == 1
+
+#define MBEDTLS_ECP_NIST_OPTIM
+
+#else
+
 #define MBEDTLS_AES_FEWER_TABLES
 
+#endif
+
 #define MBEDTLS_AES_C
 #define MBEDTLS_ASN1_PARSE_C
 #define MBEDTLS_ASN1_WRITE_C
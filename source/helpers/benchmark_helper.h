@@ -0,0 +1,336 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_BENCHMARK_HELPER_H
+#define _LORAWAN_FUOTA_BENCHMARK_HELPER_H
+
+#include "mbed.h"
+#include "storage_helper.h"
+
+#if MBED_CONF_APP_FUOTA_BENCHMARK
+
+#if !defined(TARGET_SIMULATOR)
+#error "fuota-benchmark is only supported on the SIMULATOR target"
+#endif
+
+// Longest line in a packets-plain file: 255 bytes, written as 'xx '
+#define FUOTA_BENCHMARK_LINE_LENGTH     (255 * 3 + 2)
+
+static Timer fuota_benchmark_timer;
+
+static uint32_t fuota_benchmark_now_us() {
+    return static_cast<uint32_t>(fuota_benchmark_timer.read_high_resolution_us());
+}
+
+/**
+ * Block device wrapper that accounts how long the update client spends in the underlying block device.
+ * This lets the benchmark tell flash writes apart from FEC decoding.
+ */
+class BenchmarkBlockDevice : public BlockDevice {
+public:
+    BenchmarkBlockDevice(BlockDevice *bd)
+        : read_us(0), program_us(0), erase_us(0), read_count(0), program_count(0), erase_count(0), _bd(bd)
+    {
+    }
+
+    virtual int init() { return _bd->init(); }
+    virtual int deinit() { return _bd->deinit(); }
+    virtual int sync() { return _bd->sync(); }
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) {
+        uint32_t start = fuota_benchmark_now_us();
+        int r = _bd->read(buffer, addr, size);
+        read_us += fuota_benchmark_now_us() - start;
+        read_count++;
+        return r;
+    }
+
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+        uint32_t start = fuota_benchmark_now_us();
+        int r = _bd->program(buffer, addr, size);
+        program_us += fuota_benchmark_now_us() - start;
+        program_count++;
+        return r;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        uint32_t start = fuota_benchmark_now_us();
+        int r = _bd->erase(addr, size);
+        erase_us += fuota_benchmark_now_us() - start;
+        erase_count++;
+        return r;
+    }
+
+    virtual bd_size_t get_read_size() const { return _bd->get_read_size(); }
+    virtual bd_size_t get_program_size() const { return _bd->get_program_size(); }
+    virtual bd_size_t get_erase_size() const { return _bd->get_erase_size(); }
+    virtual int get_erase_value() const { return _bd->get_erase_value(); }
+    virtual bd_size_t size() const { return _bd->size(); }
+
+    uint32_t total_us() const {
+        return read_us + program_us + erase_us;
+    }
+
+    uint32_t read_us;
+    uint32_t program_us;
+    uint32_t erase_us;
+    uint32_t read_count;
+    uint32_t program_count;
+    uint32_t erase_count;
+
+private:
+    BlockDevice *_bd;
+};
+
+BenchmarkBlockDevice benchmark_bd(&bd);
+
+typedef void (*fuota_benchmark_handler_t)(uint8_t port, uint8_t *data, size_t length);
+
+typedef struct {
+    EventQueue *queue;
+    fuota_benchmark_handler_t handler;
+    FILE *file;
+    uint16_t nb_frag;
+    uint8_t frag_size;
+    uint32_t packets_sent;
+    uint32_t packets_dropped;
+    uint32_t packets_skipped;
+    uint32_t handle_us;             // time spent in the update client while processing fragments
+    uint32_t handle_bd_us;          // part of handle_us that was spent in the block device
+    uint32_t complete_at_us;
+    uint32_t complete_bd_us;
+    uint32_t complete_bd_reads;
+    uint32_t complete_bd_programs;
+    uint32_t ready_at_us;
+    uint32_t ready_bd_us;
+    uint32_t ready_bd_reads;        // reads and programs of the underlying block device (so below the block cache)
+    uint32_t ready_bd_programs;
+    bool complete;
+    bool ready;
+    bool reported;
+} fuota_benchmark_state_t;
+
+static fuota_benchmark_state_t fuota_benchmark;
+
+// Same multicast group that fuota-server/loraserver.js sets up (McAddr 0x01FFFFFF)
+static uint8_t fuota_benchmark_mc_group_setup[] = { 0x02, 0x00,
+    0xFF, 0xFF, 0xFF, 0x01,
+    0x01, 0x5E, 0x85, 0xF4, 0xB9, 0x9D, 0xC0, 0xB9, 0x44, 0x06, 0x6C, 0xD0, 0x74, 0x98, 0x33, 0x0B,
+    0x0, 0x0, 0x0, 0x0,
+    0xff, 0x0, 0x0, 0x0
+};
+
+/**
+ * Parse a single line of a packets-plain file (space separated hex bytes, see parsePackets() in loraserver.js)
+ *
+ * @returns number of bytes parsed
+ */
+static size_t fuota_benchmark_parse_line(char *line, uint8_t *out, size_t out_size) {
+    size_t length = 0;
+    char *p = line;
+
+    while (*p && length < out_size) {
+        char *end;
+        unsigned long v = strtoul(p, &end, 16);
+        if (end == p) break;
+        out[length++] = static_cast<uint8_t>(v);
+        p = end;
+    }
+
+    return length;
+}
+
+static void fuota_benchmark_report() {
+    if (fuota_benchmark.reported) return;
+    fuota_benchmark.reported = true;
+
+    if (fuota_benchmark.file) {
+        fclose(fuota_benchmark.file);
+        fuota_benchmark.file = NULL;
+    }
+
+    uint32_t fec_us = fuota_benchmark.handle_us - fuota_benchmark.handle_bd_us;
+    uint32_t frags_per_s = 0;
+    if (fuota_benchmark.handle_us > 0) {
+        frags_per_s = static_cast<uint32_t>(
+            (static_cast<uint64_t>(fuota_benchmark.packets_sent) * 1000000ULL) / fuota_benchmark.handle_us);
+    }
+
+    mbed_stats_heap_t heap_stats;
+    mbed_stats_heap_get(&heap_stats);
+
+    printf("[BENCH] result:       %s\n", fuota_benchmark.complete ? "complete" : "INCOMPLETE");
+    printf("[BENCH] session:      nbFrag=%u fragSize=%u\n", fuota_benchmark.nb_frag, fuota_benchmark.frag_size);
+    printf("[BENCH] fragments:    %lu processed, %lu dropped, %lu redundancy packets skipped\n",
+        fuota_benchmark.packets_sent, fuota_benchmark.packets_dropped, fuota_benchmark.packets_skipped);
+    printf("[BENCH] throughput:   %lu fragments/s\n", frags_per_s);
+    printf("[BENCH] fec decode:   %lu us\n", fec_us);
+    printf("[BENCH] bd write:     %lu us (%lu programs, %lu erases)\n",
+        benchmark_bd.program_us + benchmark_bd.erase_us, benchmark_bd.program_count, benchmark_bd.erase_count);
+    printf("[BENCH] bd read:      %lu us (%lu reads)\n", benchmark_bd.read_us, benchmark_bd.read_count);
+
+    if (fuota_benchmark.ready) {
+        uint32_t verify_us = fuota_benchmark.ready_at_us - fuota_benchmark.complete_at_us;
+        uint32_t verify_bd_us = fuota_benchmark.ready_bd_us - fuota_benchmark.complete_bd_us;
+        printf("[BENCH] verify:       %lu us (of which %lu us in block device)\n", verify_us, verify_bd_us);
+        printf("[BENCH] verify bd:    %lu reads, %lu programs\n",
+            fuota_benchmark.ready_bd_reads - fuota_benchmark.complete_bd_reads,
+            fuota_benchmark.ready_bd_programs - fuota_benchmark.complete_bd_programs);
+    }
+    else if (fuota_benchmark.complete) {
+        printf("[BENCH] verify:       did not finish\n");
+    }
+
+    printf("[BENCH] heap peak:    %lu bytes\n", heap_stats.max_size);
+}
+
+static void fuota_benchmark_step() {
+    static char line[FUOTA_BENCHMARK_LINE_LENGTH];
+    static uint8_t packet[255];
+
+    if (fuota_benchmark.reported) return;
+
+    while (!fuota_benchmark.complete && fgets(line, sizeof(line), fuota_benchmark.file)) {
+        size_t length = fuota_benchmark_parse_line(line, packet, sizeof(packet));
+        if (length < 3) continue;
+
+        // DATA_FRAGMENT: 1 byte command, 2 bytes index and N, then the fragment
+        uint16_t n = (packet[1] | (packet[2] << 8)) & 0x3fff;
+
+        if (n > fuota_benchmark.nb_frag && MBED_CONF_APP_FUOTA_BENCHMARK_MAX_REDUNDANCY >= 0
+                && n - fuota_benchmark.nb_frag > MBED_CONF_APP_FUOTA_BENCHMARK_MAX_REDUNDANCY) {
+            fuota_benchmark.packets_skipped++;
+            continue;
+        }
+
+        if ((rand() % 100) < MBED_CONF_APP_FUOTA_BENCHMARK_LOSS_PERCENT) {
+            fuota_benchmark.packets_dropped++;
+            continue;
+        }
+
+        uint32_t bd_start = benchmark_bd.total_us();
+        uint32_t start = fuota_benchmark_now_us();
+        fuota_benchmark.handler(201, packet, length);
+        fuota_benchmark.packets_sent++;
+
+        if (fuota_benchmark.complete) {
+            // verification can run inside the last call, that is accounted separately
+            fuota_benchmark.handle_us += fuota_benchmark.complete_at_us - start;
+            fuota_benchmark.handle_bd_us += fuota_benchmark.complete_bd_us - bd_start;
+            break;
+        }
+
+        fuota_benchmark.handle_us += fuota_benchmark_now_us() - start;
+        fuota_benchmark.handle_bd_us += benchmark_bd.total_us() - bd_start;
+
+        // one packet per event, so work that the update client deferred to the queue gets to run
+        fuota_benchmark.queue->call(&fuota_benchmark_step);
+        return;
+    }
+
+    if (!fuota_benchmark.complete) {
+        fuota_benchmark_report();
+    }
+    else {
+        // firmwareReady is not called when verification fails, still print what we have
+        fuota_benchmark.queue->call_in(30000, &fuota_benchmark_report);
+    }
+}
+
+/**
+ * Call from the update client's fragSessionComplete callback
+ */
+void fuota_benchmark_frag_session_complete() {
+    if (fuota_benchmark.complete) return;
+
+    fuota_benchmark.complete = true;
+    fuota_benchmark.complete_at_us = fuota_benchmark_now_us();
+    fuota_benchmark.complete_bd_us = benchmark_bd.total_us();
+    fuota_benchmark.complete_bd_reads = benchmark_bd.read_count;
+    fuota_benchmark.complete_bd_programs = benchmark_bd.program_count;
+}
+
+/**
+ * Call from the update client's firmwareReady callback
+ */
+void fuota_benchmark_firmware_ready() {
+    fuota_benchmark.ready = true;
+    fuota_benchmark.ready_at_us = fuota_benchmark_now_us();
+    fuota_benchmark.ready_bd_us = benchmark_bd.total_us();
+    fuota_benchmark.ready_bd_reads = benchmark_bd.read_count;
+    fuota_benchmark.ready_bd_programs = benchmark_bd.program_count;
+
+    fuota_benchmark_report();
+}
+
+/**
+ * Replay a packets-plain file (as generated by lorawan-fota-signing-tool) through the update client
+ *
+ * @param queue     Event queue to schedule the replay on
+ * @param handler   Downlink handler, called with every packet as if it came in over the network
+ * @returns         0 if the replay was started, -1 if the packet file could not be read
+ */
+int fuota_benchmark_start(EventQueue *queue, fuota_benchmark_handler_t handler) {
+    static char line[FUOTA_BENCHMARK_LINE_LENGTH];
+    static uint8_t packet[255];
+
+    memset(&fuota_benchmark, 0, sizeof(fuota_benchmark));
+    fuota_benchmark.queue = queue;
+    fuota_benchmark.handler = handler;
+
+    fuota_benchmark.file = fopen(MBED_CONF_APP_FUOTA_BENCHMARK_PACKET_FILE, "r");
+    if (!fuota_benchmark.file) {
+        printf("[BENCH] Could not open packet file '%s'\n", MBED_CONF_APP_FUOTA_BENCHMARK_PACKET_FILE);
+        return -1;
+    }
+
+    // first row is the FragSessionSetupReq
+    if (!fgets(line, sizeof(line), fuota_benchmark.file)) {
+        printf("[BENCH] Packet file is empty\n");
+        fclose(fuota_benchmark.file);
+        fuota_benchmark.file = NULL;
+        return -1;
+    }
+
+    size_t length = fuota_benchmark_parse_line(line, packet, sizeof(packet));
+    if (length < 5) {
+        printf("[BENCH] First row is not a FragSessionSetupReq\n");
+        fclose(fuota_benchmark.file);
+        fuota_benchmark.file = NULL;
+        return -1;
+    }
+
+    fuota_benchmark.nb_frag = packet[2] | (packet[3] << 8);
+    fuota_benchmark.frag_size = packet[4];
+
+    printf("[BENCH] Replaying %s (loss %d%%, max redundancy %d, seed %d)\n",
+        MBED_CONF_APP_FUOTA_BENCHMARK_PACKET_FILE, MBED_CONF_APP_FUOTA_BENCHMARK_LOSS_PERCENT,
+        MBED_CONF_APP_FUOTA_BENCHMARK_MAX_REDUNDANCY, MBED_CONF_APP_FUOTA_BENCHMARK_SEED);
+
+    srand(MBED_CONF_APP_FUOTA_BENCHMARK_SEED);
+    fuota_benchmark_timer.start();
+
+    handler(200, fuota_benchmark_mc_group_setup, sizeof(fuota_benchmark_mc_group_setup));
+    handler(201, packet, length);
+
+    queue->call(&fuota_benchmark_step);
+    return 0;
+}
+
+#endif // MBED_CONF_APP_FUOTA_BENCHMARK
+
+#endif // _LORAWAN_FUOTA_BENCHMARK_HELPER_H
@@ -0,0 +1,281 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_BLOCK_CACHE_HELPER_H
+#define _LORAWAN_FUOTA_BLOCK_CACHE_HELPER_H
+
+#include "mbed.h"
+
+#define BLOCK_CACHE_PAGE_BUFFER_SIZE   (MBED_CONF_APP_BLOCK_CACHE_PAGE_SIZE > 0 ? MBED_CONF_APP_BLOCK_CACHE_PAGE_SIZE : 1)
+
+/**
+ * Write-back page cache in front of a block device.
+ *
+ * Fragments come in at sizes (40-204 bytes) that do not line up with the pages of the flash (528 bytes on the AT45).
+ * Without the cache every fragment becomes a read-modify-write of a full page. With the cache, consecutive fragments
+ * are merged in RAM and the page is programmed once, when it is complete, when the slot is needed for another page,
+ * or on sync().
+ *
+ * When a delta update is applied, janpatch reads the old firmware and the patch, and writes the new firmware,
+ * all through this block device. With block-cache-slots set to 3 or more every stream keeps its own page,
+ * rather than the streams evicting each other on every access. Slots are replaced least recently used first.
+ *
+ * The cache exposes a program and read size of 1 byte. If block-cache-page-size is 0, or is not a multiple of the
+ * program and read size of the underlying block device, all calls are passed through.
+ */
+class PageCacheBlockDevice : public BlockDevice {
+public:
+    PageCacheBlockDevice(BlockDevice *bd)
+        : page_programs(0), read_hits(0), read_misses(0), write_hits(0), write_misses(0), evictions(0),
+          _bd(bd), _page_size(MBED_CONF_APP_BLOCK_CACHE_PAGE_SIZE), _clock(0)
+    {
+        memset(_slots, 0, sizeof(_slots));
+    }
+
+    virtual int init() {
+        int r = _bd->init();
+        if (r != BD_ERROR_OK) return r;
+
+        if (_page_size != 0 && (_page_size % _bd->get_program_size() != 0 || _page_size % _bd->get_read_size() != 0)) {
+            printf("Block cache: page size %u does not match the block device, disabling cache\n", _page_size);
+            _page_size = 0;
+        }
+
+        for (size_t ix = 0; ix < MBED_CONF_APP_BLOCK_CACHE_SLOTS; ix++) {
+            _slots[ix].valid = false;
+            _slots[ix].dirty = false;
+        }
+        return BD_ERROR_OK;
+    }
+
+    virtual int deinit() {
+        int r = flush_all();
+        if (r != BD_ERROR_OK) return r;
+        return _bd->deinit();
+    }
+
+    virtual int sync() {
+        int r = flush_all();
+        if (r != BD_ERROR_OK) return r;
+        return _bd->sync();
+    }
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) {
+        if (_page_size == 0) return _bd->read(buffer, addr, size);
+
+        uint8_t *out = static_cast<uint8_t*>(buffer);
+
+        while (size > 0) {
+            bd_addr_t page = addr - (addr % _page_size);
+            bd_size_t offset = addr - page;
+            bd_size_t length = page_length(page);
+            bd_size_t chunk = size < length - offset ? size : length - offset;
+
+            slot_t *slot = find(page);
+
+            if (slot) {
+                memcpy(out, slot->data + offset, chunk);
+                read_hits++;
+            }
+            else if (offset == 0 && chunk == length) {
+                // full page, no need to go through the cache
+                int r = _bd->read(out, addr, chunk);
+                if (r != BD_ERROR_OK) return r;
+            }
+            else {
+                int r = load(page, &slot);
+                if (r != BD_ERROR_OK) return r;
+                memcpy(out, slot->data + offset, chunk);
+                read_misses++;
+            }
+
+            out += chunk;
+            addr += chunk;
+            size -= chunk;
+        }
+
+        return BD_ERROR_OK;
+    }
+
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+        if (_page_size == 0) return _bd->program(buffer, addr, size);
+
+        const uint8_t *in = static_cast<const uint8_t*>(buffer);
+
+        while (size > 0) {
+            bd_addr_t page = addr - (addr % _page_size);
+            bd_size_t offset = addr - page;
+            bd_size_t length = page_length(page);
+            bd_size_t chunk = size < length - offset ? size : length - offset;
+
+            slot_t *slot = find(page);
+
+            if (!slot && offset == 0 && chunk == length) {
+                // full page, no need to go through the cache
+                int r = _bd->program(in, addr, chunk);
+                if (r != BD_ERROR_OK) return r;
+                page_programs++;
+            }
+            else {
+                if (slot) {
+                    write_hits++;
+                }
+                else {
+                    int r = load(page, &slot);
+                    if (r != BD_ERROR_OK) return r;
+                    write_misses++;
+                }
+
+                memcpy(slot->data + offset, in, chunk);
+                slot->dirty = true;
+
+                // page is complete, write it out
+                if (offset + chunk == length) {
+                    int r = flush(slot);
+                    if (r != BD_ERROR_OK) return r;
+                }
+            }
+
+            in += chunk;
+            addr += chunk;
+            size -= chunk;
+        }
+
+        return BD_ERROR_OK;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        for (size_t ix = 0; ix < MBED_CONF_APP_BLOCK_CACHE_SLOTS; ix++) {
+            slot_t *slot = &_slots[ix];
+            if (!slot->valid) continue;
+
+            bd_addr_t end = slot->addr + page_length(slot->addr);
+            if (slot->addr >= addr + size || addr >= end) continue;
+
+            // page only partly erased, the rest needs to be written out first
+            if (slot->addr < addr || end > addr + size) {
+                int r = flush(slot);
+                if (r != BD_ERROR_OK) return r;
+            }
+            slot->valid = false;
+            slot->dirty = false;
+        }
+
+        return _bd->erase(addr, size);
+    }
+
+    virtual bd_size_t get_read_size() const { return _page_size ? 1 : _bd->get_read_size(); }
+    virtual bd_size_t get_program_size() const { return _page_size ? 1 : _bd->get_program_size(); }
+    virtual bd_size_t get_erase_size() const { return _bd->get_erase_size(); }
+    virtual int get_erase_value() const { return _bd->get_erase_value(); }
+    virtual bd_size_t size() const { return _bd->size(); }
+
+    void print_stats() {
+        printf("Block cache: %lu page programs, reads %lu hits / %lu misses, writes %lu hits / %lu misses, %lu evictions\n",
+            page_programs, read_hits, read_misses, write_hits, write_misses, evictions);
+    }
+
+    uint32_t page_programs;     // pages programmed to the underlying block device
+    uint32_t read_hits;         // partial page reads served from the cache
+    uint32_t read_misses;       // partial page reads that loaded a page
+    uint32_t write_hits;        // partial page writes merged into a cached page (read-modify-writes avoided)
+    uint32_t write_misses;      // partial page writes that loaded a page
+    uint32_t evictions;         // pages dropped from the cache to make room for another page
+
+private:
+    typedef struct {
+        bool valid;
+        bool dirty;
+        bd_addr_t addr;
+        uint32_t last_used;
+        uint8_t data[BLOCK_CACHE_PAGE_BUFFER_SIZE];
+    } slot_t;
+
+    // the last page can be shorter if the block device size is not a multiple of the page size
+    bd_size_t page_length(bd_addr_t page) const {
+        bd_size_t left = _bd->size() - page;
+        return left < _page_size ? left : _page_size;
+    }
+
+    slot_t *find(bd_addr_t page) {
+        for (size_t ix = 0; ix < MBED_CONF_APP_BLOCK_CACHE_SLOTS; ix++) {
+            if (_slots[ix].valid && _slots[ix].addr == page) {
+                _slots[ix].last_used = ++_clock;
+                return &_slots[ix];
+            }
+        }
+        return NULL;
+    }
+
+    int load(bd_addr_t page, slot_t **out) {
+        // empty slot, or the least recently used one
+        slot_t *slot = &_slots[0];
+        for (size_t ix = 0; ix < MBED_CONF_APP_BLOCK_CACHE_SLOTS; ix++) {
+            if (!_slots[ix].valid) {
+                slot = &_slots[ix];
+                break;
+            }
+            if (_slots[ix].last_used < slot->last_used) {
+                slot = &_slots[ix];
+            }
+        }
+
+        if (slot->valid) {
+            int r = flush(slot);
+            if (r != BD_ERROR_OK) return r;
+            evictions++;
+        }
+
+        slot->valid = false;
+        slot->dirty = false;
+
+        int r = _bd->read(slot->data, page, page_length(page));
+        if (r != BD_ERROR_OK) return r;
+
+        slot->addr = page;
+        slot->valid = true;
+        slot->last_used = ++_clock;
+        *out = slot;
+        return BD_ERROR_OK;
+    }
+
+    int flush(slot_t *slot) {
+        if (!slot->valid || !slot->dirty) return BD_ERROR_OK;
+
+        int r = _bd->program(slot->data, slot->addr, page_length(slot->addr));
+        if (r != BD_ERROR_OK) return r;
+
+        slot->dirty = false;
+        page_programs++;
+        return BD_ERROR_OK;
+    }
+
+    int flush_all() {
+        for (size_t ix = 0; ix < MBED_CONF_APP_BLOCK_CACHE_SLOTS; ix++) {
+            int r = flush(&_slots[ix]);
+            if (r != BD_ERROR_OK) return r;
+        }
+        return BD_ERROR_OK;
+    }
+
+    BlockDevice *_bd;
+    bd_size_t _page_size;
+    uint32_t _clock;
+    slot_t _slots[MBED_CONF_APP_BLOCK_CACHE_SLOTS];
+};
+
+#endif // _LORAWAN_FUOTA_BLOCK_CACHE_HELPER_H
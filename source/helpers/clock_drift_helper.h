@@ -0,0 +1,158 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_CLOCK_DRIFT_HELPER_H
+#define _LORAWAN_FUOTA_CLOCK_DRIFT_HELPER_H
+
+#include "mbed.h"
+
+// AppTimeAns: CID, TimeCorrection (int32, seconds), TokenAns
+#define CLOCK_APP_TIME_ANS                  0x01
+#define CLOCK_APP_TIME_ANS_LENGTH           6
+
+// McClassCSessionReq: CID, McGroupIDHeader, SessionTime (4), SessionTimeOut, DLFrequency (3), DR
+#define MC_CLASSC_SESSION_REQ               0x04
+#define MC_CLASSC_SESSION_REQ_LENGTH        11
+
+// Don't ask for another clock sync within this time, if the last request was not answered
+#define CLOCK_RESYNC_RETRY_MS               60000
+
+/**
+ * Estimates the drift of the oscillator that the update client's clock runs on, from the corrections in the
+ * AppTimeAns messages the device gets over time.
+ *
+ * After the first sync, every correction is the time the clock gained or lost since the previous sync, so the
+ * drift is the sum of the corrections over the time they were collected. Corrections come in whole seconds, so
+ * the estimate is only good to 1 second over that time, which is also how it gets better with every sync.
+ *
+ * With the estimate, the start time in a McClassCSessionReq can be moved to where the device's clock will be,
+ * and a new clock sync is due when the error that's left (the uncertainty of the estimate times the time since
+ * the last sync) exceeds MBED_CONF_APP_CLOCK_RESYNC_THRESHOLD_MS.
+ */
+class ClockDrift {
+public:
+    ClockDrift() : _syncs(0), _last_sync_ms(0), _requested_ms(0), _requested(false), _span_ms(0), _correction_sum_s(0) {
+    }
+
+    /**
+     * Call with an AppTimeAns that the update client accepted
+     *
+     * @param buffer    The AppTimeAns
+     * @param now_ms    Current tick
+     */
+    void on_time_ans(const uint8_t *buffer, size_t length, uint32_t now_ms) {
+        if (length < CLOCK_APP_TIME_ANS_LENGTH || buffer[0] != CLOCK_APP_TIME_ANS) return;
+
+        int32_t correction = static_cast<int32_t>(buffer[1] | (buffer[2] << 8) | (buffer[3] << 16) | (buffer[4] << 24));
+
+        // the first correction sets the clock, it says nothing about the drift
+        if (_syncs > 0) {
+            _span_ms += now_ms - _last_sync_ms;
+            _correction_sum_s += correction;
+        }
+        _syncs++;
+        _last_sync_ms = now_ms;
+        _requested = false;
+
+        if (_syncs > 1) {
+            printf("Clock sync: corrected %ld s, drift %ld ppm +/- %lu ppm (over %lu s, %lu syncs)\n",
+                correction, drift_ppm(), uncertainty_ppm(), static_cast<uint32_t>(_span_ms / 1000), _syncs);
+        }
+    }
+
+    /**
+     * Drift of the clock, positive if it runs fast
+     */
+    int32_t drift_ppm() const {
+        if (_span_ms == 0) return 0;
+        // the clock ran fast if the server had to put it back
+        return static_cast<int32_t>(-_correction_sum_s * 1000000000LL / static_cast<int64_t>(_span_ms));
+    }
+
+    /**
+     * How far off the drift estimate can be, 1 second over the time the corrections were collected,
+     * capped at what the crystal is specified for
+     */
+    uint32_t uncertainty_ppm() const {
+        if (_span_ms == 0) return MBED_CONF_APP_CLOCK_DRIFT_MAX_PPM;
+
+        uint64_t ppm = 1000000000ULL / _span_ms;
+        return ppm < MBED_CONF_APP_CLOCK_DRIFT_MAX_PPM ? static_cast<uint32_t>(ppm) : MBED_CONF_APP_CLOCK_DRIFT_MAX_PPM;
+    }
+
+    /**
+     * How far the device's clock is ahead of the server's clock now, from the drift estimate
+     */
+    int32_t predicted_offset_ms(uint32_t now_ms) const {
+        if (_syncs < 2) return 0;
+        return static_cast<int32_t>(static_cast<int64_t>(drift_ppm()) * (now_ms - _last_sync_ms) / 1000000LL);
+    }
+
+    /**
+     * Error that's left after correcting for the drift
+     */
+    uint32_t predicted_error_ms(uint32_t now_ms) const {
+        return static_cast<uint32_t>(static_cast<uint64_t>(uncertainty_ppm()) * (now_ms - _last_sync_ms) / 1000000ULL);
+    }
+
+    bool resync_due(uint32_t now_ms) const {
+        if (_requested && now_ms - _requested_ms < CLOCK_RESYNC_RETRY_MS) return false;
+        return _syncs > 0 && predicted_error_ms(now_ms) > MBED_CONF_APP_CLOCK_RESYNC_THRESHOLD_MS;
+    }
+
+    /**
+     * Call when a clock sync was requested because resync_due() said so
+     */
+    void resync_requested(uint32_t now_ms) {
+        _requested = true;
+        _requested_ms = now_ms;
+    }
+
+    /**
+     * Move the SessionTime of a McClassCSessionReq to the device's clock, so the time to start
+     * that the update client calculates is corrected for the drift since the last sync.
+     * Only whole seconds can be corrected, like the clock itself.
+     *
+     * @returns The correction in seconds
+     */
+    int32_t correct_class_c_session_req(uint8_t *buffer, size_t length, uint32_t now_ms) const {
+        if (length != MC_CLASSC_SESSION_REQ_LENGTH || buffer[0] != MC_CLASSC_SESSION_REQ) return 0;
+
+        int32_t offset_ms = predicted_offset_ms(now_ms);
+        int32_t offset_s = (offset_ms + (offset_ms >= 0 ? 500 : -500)) / 1000;
+        if (offset_s == 0) return 0;
+
+        uint32_t session_time = buffer[2] | (buffer[3] << 8) | (buffer[4] << 16) | (buffer[5] << 24);
+        session_time += offset_s;
+
+        buffer[2] = session_time & 0xff;
+        buffer[3] = (session_time >> 8) & 0xff;
+        buffer[4] = (session_time >> 16) & 0xff;
+        buffer[5] = (session_time >> 24) & 0xff;
+        return offset_s;
+    }
+
+private:
+    uint32_t _syncs;
+    uint32_t _last_sync_ms;
+    uint32_t _requested_ms;
+    bool _requested;
+    uint64_t _span_ms;              // time over which the corrections were collected
+    int64_t _correction_sum_s;
+};
+
+#endif // _LORAWAN_FUOTA_CLOCK_DRIFT_HELPER_H
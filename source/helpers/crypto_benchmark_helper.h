@@ -0,0 +1,166 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_CRYPTO_BENCHMARK_HELPER_H
+#define _LORAWAN_FUOTA_CRYPTO_BENCHMARK_HELPER_H
+
+#include "mbed.h"
+
+#if MBED_CONF_APP_CRYPTO_BENCHMARK
+
+#include "mbedtls/aes.h"
+#include "mbedtls/cipher.h"
+#include "mbedtls/cmac.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/hmac_drbg.h"
+#include "mbedtls/md.h"
+
+#define CRYPTO_BENCHMARK_AES_ROUNDS     1000
+#define CRYPTO_BENCHMARK_CMAC_ROUNDS    1000
+#define CRYPTO_BENCHMARK_SHA256_BYTES   (64 * 1024)
+#define CRYPTO_BENCHMARK_ECDSA_ROUNDS   3
+
+static const char *crypto_benchmark_profile_name() {
+#if MBED_CONF_APP_CRYPTO_PROFILE == 1
+    return "fast";
+#else
+    return "small";
+#endif
+}
+
+/**
+ * Time the crypto operations that the update client runs, with the crypto profile that was compiled in.
+ * The keys and data are fixed, this only measures speed.
+ *
+ * @returns 0 if all operations succeeded
+ */
+static int crypto_benchmark_run() {
+    static const uint8_t key[16] = { 0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C };
+    uint8_t block[64];
+    uint8_t out[32];
+    Timer timer;
+    int r;
+
+    memset(block, 0xA5, sizeof(block));
+
+    printf("[CRYPTO] Profile: %s\n", crypto_benchmark_profile_name());
+
+    // McKey = aes128_encrypt(McKEKey, McKey_encrypted), one block per McGroupSetupReq
+    mbedtls_aes_context aes;
+    mbedtls_aes_init(&aes);
+    mbedtls_aes_setkey_enc(&aes, key, 128);
+
+    timer.start();
+    for (int ix = 0; ix < CRYPTO_BENCHMARK_AES_ROUNDS; ix++) {
+        mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_ENCRYPT, block, block);
+    }
+    printf("[CRYPTO] McKey decrypt:  %lu us per block\n",
+        static_cast<uint32_t>(timer.read_high_resolution_us() / CRYPTO_BENCHMARK_AES_ROUNDS));
+    mbedtls_aes_free(&aes);
+
+    // MIC of a frame (B0 block + 51 byte payload)
+    const mbedtls_cipher_info_t *cipher_info = mbedtls_cipher_info_from_type(MBEDTLS_CIPHER_AES_128_ECB);
+
+    timer.reset();
+    for (int ix = 0; ix < CRYPTO_BENCHMARK_CMAC_ROUNDS; ix++) {
+        r = mbedtls_cipher_cmac(cipher_info, key, 128, block, sizeof(block), out);
+        if (r != 0) {
+            printf("[CRYPTO] AES-CMAC failed (%d)\n", r);
+            return r;
+        }
+    }
+    printf("[CRYPTO] AES-CMAC:       %lu us per 64 byte frame\n",
+        static_cast<uint32_t>(timer.read_high_resolution_us() / CRYPTO_BENCHMARK_CMAC_ROUNDS));
+
+    // SHA256, as run over the firmware image
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+
+    timer.reset();
+    for (size_t ix = 0; ix < CRYPTO_BENCHMARK_SHA256_BYTES; ix += sizeof(block)) {
+        mbedtls_sha256_update_ret(&sha, block, sizeof(block));
+    }
+    mbedtls_sha256_finish_ret(&sha, out);
+    uint32_t sha_us = static_cast<uint32_t>(timer.read_high_resolution_us());
+    printf("[CRYPTO] SHA256:         %lu us per KB (%lu KB/s)\n",
+        sha_us / (CRYPTO_BENCHMARK_SHA256_BYTES / 1024),
+        sha_us > 0 ? static_cast<uint32_t>(CRYPTO_BENCHMARK_SHA256_BYTES * 1000ULL / sha_us) : 0);
+    mbedtls_sha256_free(&sha);
+
+    // ECDSA (secp256r1) over the hash, with a key generated from a fixed seed
+    mbedtls_hmac_drbg_context drbg;
+    mbedtls_ecdsa_context ecdsa;
+    mbedtls_mpi sig_r, sig_s;
+
+    mbedtls_hmac_drbg_init(&drbg);
+    mbedtls_ecdsa_init(&ecdsa);
+    mbedtls_mpi_init(&sig_r);
+    mbedtls_mpi_init(&sig_s);
+
+    r = mbedtls_hmac_drbg_seed_buf(&drbg, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, sizeof(key));
+    if (r == 0) {
+        r = mbedtls_ecdsa_genkey(&ecdsa, MBEDTLS_ECP_DP_SECP256R1, mbedtls_hmac_drbg_random, &drbg);
+    }
+    if (r == 0) {
+        r = mbedtls_ecdsa_sign_det(&ecdsa.grp, &sig_r, &sig_s, &ecdsa.d, out, 32, MBEDTLS_MD_SHA256);
+    }
+
+    // signing already built the fixed-point comb in ecdsa.grp, verify on a fresh group like the update client does
+    mbedtls_ecp_group grp;
+    mbedtls_ecp_group_init(&grp);
+
+    if (r == 0) {
+        r = mbedtls_ecp_group_load(&grp, MBEDTLS_ECP_DP_SECP256R1);
+    }
+
+    if (r == 0) {
+        timer.reset();
+        r = mbedtls_ecdsa_verify(&grp, out, 32, &ecdsa.Q, &sig_r, &sig_s);
+        uint32_t first_us = static_cast<uint32_t>(timer.read_high_resolution_us());
+
+        // later verifies on the same group reuse the comb
+        timer.reset();
+        for (int ix = 0; ix < CRYPTO_BENCHMARK_ECDSA_ROUNDS && r == 0; ix++) {
+            r = mbedtls_ecdsa_verify(&grp, out, 32, &ecdsa.Q, &sig_r, &sig_s);
+        }
+        uint32_t verify_us = static_cast<uint32_t>(timer.read_high_resolution_us() / CRYPTO_BENCHMARK_ECDSA_ROUNDS);
+
+        mbed_stats_heap_t heap_stats;
+        mbed_stats_heap_get(&heap_stats);
+        printf("[CRYPTO] ECDSA verify:   %lu ms one-shot, as in the update client (heap high-water mark %lu bytes)\n",
+            first_us / 1000, heap_stats.max_size);
+        printf("[CRYPTO] ECDSA verify:   %lu ms average of %d more on the same group\n", verify_us / 1000, CRYPTO_BENCHMARK_ECDSA_ROUNDS);
+    }
+
+    if (r != 0) {
+        printf("[CRYPTO] ECDSA failed (%d)\n", r);
+    }
+
+    mbedtls_ecp_group_free(&grp);
+    mbedtls_mpi_free(&sig_r);
+    mbedtls_mpi_free(&sig_s);
+    mbedtls_ecdsa_free(&ecdsa);
+    mbedtls_hmac_drbg_free(&drbg);
+
+    return r;
+}
+
+#endif // MBED_CONF_APP_CRYPTO_BENCHMARK
+
+#endif // _LORAWAN_FUOTA_CRYPTO_BENCHMARK_HELPER_H
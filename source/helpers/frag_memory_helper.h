@@ -0,0 +1,161 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_FRAG_MEMORY_HELPER_H
+#define _LORAWAN_FUOTA_FRAG_MEMORY_HELPER_H
+
+#include "mbed.h"
+
+// Fragmentation sessions in Fragmented Data Block Transport v1.0.0 (FragIndex is 2 bits)
+#define FRAG_SESSIONS_MAX                       4
+
+#define FRAG_SESSION_SETUP_REQ                  0x02
+#define FRAG_SESSION_SETUP_REQ_LENGTH           11
+#define FRAG_SESSION_SETUP_ANS                  0x02
+#define FRAG_SESSION_SETUP_ANS_NOT_ENOUGH_MEMORY 0x02
+#define FRAG_SESSION_SETUP_ANS_INDEX_NOT_SUPPORTED 0x04
+#define FRAG_SESSION_STATUS_REQ                 0x01
+#define FRAG_SESSION_STATUS_ANS                 0x01
+#define FRAG_SESSION_STATUS_ANS_LENGTH          5
+#define DATA_FRAGMENT                           0x08
+#define DATA_FRAGMENT_HEADER_LENGTH             3
+
+// Bookkeeping per allocation, worst case for the allocations below (12 bytes or more): newlib's chunk header (4 bytes)
+// and rounding the chunk up to 8 bytes (7), plus the header of mbed's heap statistics wrapper (alloc_info_t, 8 bytes).
+// The heap statistics only count the requested sizes, so this is not in the numbers that frag_memory_heap_free() uses.
+#if MBED_HEAP_STATS_ENABLED
+#define FRAG_MEMORY_MALLOC_OVERHEAD             (4 + 7 + 8)
+#else
+#define FRAG_MEMORY_MALLOC_OVERHEAD             (4 + 7)
+#endif
+
+// Allocations that frag_session_heap_needed() counts
+#define FRAG_MEMORY_ALLOCATIONS                 8
+
+typedef struct {
+    uint8_t frag_index;
+    uint8_t mc_group_bitmask;
+    uint16_t nb_frag;
+    uint8_t frag_size;
+    uint8_t control;
+    uint8_t padding;
+    uint32_t descriptor;
+} frag_session_setup_t;
+
+/**
+ * Parse a FragSessionSetupReq (Fragmented Data Block Transport v1.0.0, section 5.3)
+ *
+ * @returns true if the buffer holds a FragSessionSetupReq
+ */
+static bool frag_session_setup_parse(const uint8_t *buffer, size_t length, frag_session_setup_t *setup) {
+    if (length != FRAG_SESSION_SETUP_REQ_LENGTH || buffer[0] != FRAG_SESSION_SETUP_REQ) {
+        return false;
+    }
+
+    setup->frag_index = (buffer[1] >> 4) & 0x3;
+    setup->mc_group_bitmask = buffer[1] & 0xf;
+    setup->nb_frag = buffer[2] | (buffer[3] << 8);
+    setup->frag_size = buffer[4];
+    setup->control = buffer[5];
+    setup->padding = buffer[6];
+    setup->descriptor = buffer[7] | (buffer[8] << 8) | (buffer[9] << 16) | (buffer[10] << 24);
+    return true;
+}
+
+/**
+ * Heap needed by the fragmentation session for a given number of fragments, fragment size and redundancy.
+ * Mirrors the allocations that FragmentationMath makes when the session is set up:
+ * the redundancy matrix (bit packed), the missing fragment index, a matrix row,
+ * three redundancy-sized vectors and two fragment-sized scratch buffers.
+ *
+ * Written against FragmentationMath in mbed-lorawan-update-client da8bf497eeee02053265cd56c6636a28c819eb32
+ * (see mbed-lorawan-update-client.lib). Check it again when updating the library, frag_session_heap_check()
+ * compares it with what the update client actually allocates.
+ */
+static uint32_t frag_session_heap_needed(uint16_t nb_frag, uint8_t frag_size, uint16_t redundancy) {
+    uint32_t needed = 0;
+
+    needed += ((redundancy / 8) + 1) * redundancy + FRAG_MEMORY_MALLOC_OVERHEAD;   // matrixM2B
+    needed += nb_frag * sizeof(uint16_t) + FRAG_MEMORY_MALLOC_OVERHEAD;             // missingFrameIndex
+    needed += nb_frag + FRAG_MEMORY_MALLOC_OVERHEAD;                                // matrixRow
+    needed += 3 * (redundancy + FRAG_MEMORY_MALLOC_OVERHEAD);                       // dataTempVector(2), s
+    needed += 2 * (frag_size + FRAG_MEMORY_MALLOC_OVERHEAD);                        // matrixDataTemp, xorRowDataTemp
+
+    return needed;
+}
+
+/**
+ * Free heap, based on the heap statistics
+ *
+ * @returns free heap in bytes, or -1 if this is unknown
+ */
+static int32_t frag_memory_heap_free() {
+    mbed_stats_heap_t heap_stats;
+    mbed_stats_heap_get(&heap_stats);
+
+    if (heap_stats.reserved_size == 0) {
+        return -1;
+    }
+
+    return static_cast<int32_t>(heap_stats.reserved_size - heap_stats.current_size);
+}
+
+/**
+ * Compare the heap that the update client took to set up a fragmentation session with frag_session_heap_needed().
+ * Needs MBED_HEAP_STATS_ENABLED, call with the heap statistics from right before the FragSessionSetupReq was handled,
+ * and only when no session was replaced (that frees the old session's memory).
+ *
+ * The allocated bytes plus FRAG_MEMORY_MALLOC_OVERHEAD per allocation must not be more than the estimate,
+ * otherwise sessions are accepted that don't fit. In the fuota-benchmark build (which sets up a real session)
+ * this fails an assert, otherwise it prints a warning.
+ *
+ * @returns true if the estimate covers what was allocated
+ */
+static bool frag_session_heap_check(const mbed_stats_heap_t *before, uint16_t nb_frag, uint8_t frag_size, uint16_t redundancy) {
+    mbed_stats_heap_t after;
+    mbed_stats_heap_get(&after);
+
+    uint32_t allocations = after.alloc_cnt - before->alloc_cnt;
+    uint32_t used = after.current_size - before->current_size + allocations * FRAG_MEMORY_MALLOC_OVERHEAD;
+    uint32_t needed = frag_session_heap_needed(nb_frag, frag_size, redundancy);
+
+    if (used > needed) {
+        printf("FragSession took %lu bytes of heap in %lu allocations, but %lu bytes in %d allocations were expected, update frag_session_heap_needed()\n",
+            used, allocations, needed, FRAG_MEMORY_ALLOCATIONS);
+    }
+#if MBED_CONF_APP_FUOTA_BENCHMARK
+    MBED_ASSERT(used <= needed);
+#endif
+
+    return used <= needed;
+}
+
+/**
+ * Largest redundancy (up to max_redundancy) for which the fragmentation session fits in the given budget
+ *
+ * @returns redundancy, or 0 if not even a session without redundancy fits
+ */
+static uint16_t frag_session_max_redundancy(uint16_t nb_frag, uint8_t frag_size, uint16_t max_redundancy, uint32_t budget) {
+    for (uint16_t redundancy = max_redundancy; redundancy > 0; redundancy--) {
+        if (frag_session_heap_needed(nb_frag, frag_size, redundancy) <= budget) {
+            return redundancy;
+        }
+    }
+    return 0;
+}
+
+#endif // _LORAWAN_FUOTA_FRAG_MEMORY_HELPER_H
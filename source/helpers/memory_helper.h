@@ -20,18 +20,19 @@
 
 #include "mbed.h"
 #include "mbed_mem_trace.h"
+#include <stdarg.h>
 
-void print_memory_info() {
+// Threads to print stack statistics for, the array lives on the stack so it does not show up in the heap numbers
+#define MEMORY_INFO_THREADS_MAX     8
+
+static void print_memory_info() {
 #if MBED_CONF_RTOS_PRESENT
-    // allocate enough room for every thread's stack statistics
-    int cnt = osThreadGetCount();
-    mbed_stats_stack_t *stats = (mbed_stats_stack_t*) malloc(cnt * sizeof(mbed_stats_stack_t));
+    mbed_stats_stack_t stats[MEMORY_INFO_THREADS_MAX];
 
-    cnt = mbed_stats_stack_get_each(stats, cnt);
+    int cnt = mbed_stats_stack_get_each(stats, MEMORY_INFO_THREADS_MAX);
     for (int i = 0; i < cnt; i++) {
         printf("Thread: 0x%lX, Stack size: %lu / %lu\r\n", stats[i].thread_id, stats[i].max_size, stats[i].reserved_size);
     }
-    free(stats);
 #endif
 
     // Grab the heap statistics
@@ -40,4 +41,401 @@ void print_memory_info() {
     printf("Heap size: %lu / %lu bytes (max: %lu bytes)\r\n", heap_stats.current_size, heap_stats.reserved_size, heap_stats.max_size);
 }
 
+#if MBED_CONF_APP_MEM_PROFILE
+
+#if !MBED_MEM_TRACING_ENABLED || !MBED_HEAP_STATS_ENABLED
+#error "mem-profile needs MBED_MEM_TRACING_ENABLED=1 and MBED_HEAP_STATS_ENABLED=1 in the macros section of mbed_app.json"
+#endif
+
+// The stack watermark can only be reset with the RTOS, it is the fill pattern that RTX paints new threads with
+#define MEM_PROFILE_STACK           (MBED_CONF_RTOS_PRESENT && MBED_STACK_STATS_ENABLED)
+
+#if MEM_PROFILE_STACK
+#include "rtx_os.h"
+#endif
+
+// Call sites reported per phase
+#define MEM_PROFILE_TOP             3
+
+// Stack right below the current stack pointer that is left alone when the watermark is reset (in words)
+#define MEM_PROFILE_STACK_MARGIN    16
+
+// Block device reads (in bytes) without a write in between, after which the update client is reading back the image
+#define MEM_PROFILE_VERIFY_READ     4096
+
+enum mem_phase_t {
+    MEM_PHASE_JOIN = 0,         // boot until the device joined
+    MEM_PHASE_SETUP,            // clock sync, multicast and fragmentation session setup (Class A)
+    MEM_PHASE_CLASS_C,          // receiving data fragments
+    MEM_PHASE_FEC,              // receiving parity fragments, the update client decodes the missing data fragments
+    MEM_PHASE_VERIFY,           // session complete, hashing the image and verifying the signature
+    MEM_PHASE_DELTA,            // applying a delta update (the update client writes the new firmware)
+    MEM_PHASE_COUNT
+};
+
+static const char *mem_phase_names[MEM_PHASE_COUNT] = { "join", "setup", "classc", "fec", "verify", "delta" };
+
+/**
+ * Records the peak heap and stack use per phase of a firmware update, and which call sites held the heap at the peak.
+ *
+ * Every allocation goes through the mem-trace callback, which keeps the live allocations and the bytes per call site
+ * in fixed tables (sized with mem-profile-allocations and mem-profile-sites), so profiling does not allocate itself.
+ * When the heap (as counted by the heap stats) reaches a new peak in the current phase, the largest call sites are
+ * copied into the phase. Failed allocations are recorded with their size and call site.
+ *
+ * Stack is measured for the thread that calls start() (the one that dispatches the event queue, which runs the
+ * LoRaWAN stack and the update client). Its watermark is painted over on every phase change, so each phase gets
+ * its own high-water mark.
+ *
+ * The call sites are return addresses, look them up with `arm-none-eabi-addr2line -f -e <application>.elf <address>`.
+ */
+class MemProfile {
+public:
+    MemProfile() : _phase(MEM_PHASE_JOIN), _untracked(0), _read_since_program(0)
+#if MEM_PROFILE_STACK
+        , _thread(NULL)
+#endif
+    {
+        memset(_phases, 0, sizeof(_phases));
+        memset(_allocations, 0, sizeof(_allocations));
+        memset(_sites, 0, sizeof(_sites));
+    }
+
+    /**
+     * Start profiling, the first phase is MEM_PHASE_JOIN
+     */
+    void start() {
+        _instance = this;
+
+#if MEM_PROFILE_STACK
+        _thread = osThreadGetId();
+#endif
+
+        mbed_stats_heap_t heap;
+        mbed_stats_heap_get(&heap);
+        _phases[_phase].entered = true;
+        _phases[_phase].heap_start = _phases[_phase].heap_peak = heap.current_size;
+
+        reset_stack();
+
+        mbed_mem_trace_set_callback(&MemProfile::trace_cb);
+    }
+
+    /**
+     * Move to another phase, a phase that was entered before continues its own record
+     */
+    void enter(mem_phase_t phase) {
+        if (phase == _phase || !_instance) return;
+
+        sample_stack();
+
+        mbed_stats_heap_t heap;
+        mbed_stats_heap_get(&heap);
+
+        mem_phase_record_t *record = &_phases[phase];
+        if (!record->entered) {
+            record->entered = true;
+            record->heap_start = heap.current_size;
+        }
+        if (heap.current_size > record->heap_peak) {
+            record->heap_peak = heap.current_size;
+            take_top(record);
+        }
+
+        _phase = phase;
+        _read_since_program = 0;
+
+        reset_stack();
+    }
+
+    mem_phase_t phase() const {
+        return _phase;
+    }
+
+    /**
+     * The update client wrote to the block device after the session completed, it is applying a delta update
+     */
+    void on_program() {
+        _read_since_program = 0;
+        if (_phase == MEM_PHASE_VERIFY) {
+            enter(MEM_PHASE_DELTA);
+        }
+    }
+
+    /**
+     * A long run of reads without writes after the session completed, the update client is hashing the image
+     */
+    void on_read(bd_size_t size) {
+        if (_phase != MEM_PHASE_DELTA) return;
+
+        _read_since_program += size;
+        if (_read_since_program >= MEM_PROFILE_VERIFY_READ) {
+            enter(MEM_PHASE_VERIFY);
+        }
+    }
+
+    void report() {
+        sample_stack();
+
+        printf("[MEM] phase    heap start     peak   stack  failed\n");
+        for (uint8_t ix = 0; ix < MEM_PHASE_COUNT; ix++) {
+            const mem_phase_record_t *record = &_phases[ix];
+            if (!record->entered) continue;
+
+            printf("[MEM] %-7s %11lu %8lu %7lu %7lu%s\n", mem_phase_names[ix], record->heap_start, record->heap_peak,
+                record->stack_peak, record->failed, ix == _phase ? " (current)" : "");
+
+            for (uint8_t top = 0; top < MEM_PROFILE_TOP && record->top[top].bytes > 0; top++) {
+                if (record->top[top].caller) {
+                    printf("[MEM]   %p %7lu bytes in %u allocations\n", record->top[top].caller,
+                        record->top[top].bytes, record->top[top].count);
+                }
+                else {
+                    printf("[MEM]   (other)    %7lu bytes in %u allocations\n", record->top[top].bytes, record->top[top].count);
+                }
+            }
+            if (record->failed > 0) {
+                printf("[MEM]   failed: %lu bytes at %p\n", record->failed_size, record->failed_caller);
+            }
+        }
+
+        if (_untracked > 0) {
+            printf("[MEM] %lu allocations were not tracked, increase mem-profile-allocations\n", _untracked);
+        }
+
+        print_memory_info();
+    }
+
+private:
+    typedef struct {
+        void *ptr;
+        uint32_t size;
+        uint8_t site;
+    } mem_allocation_t;
+
+    typedef struct {
+        void *caller;               // NULL for the last site, which takes the call sites that did not fit
+        uint32_t bytes;             // live bytes
+        uint16_t count;             // live allocations
+    } mem_site_t;
+
+    typedef struct {
+        bool entered;
+        uint32_t heap_start;        // heap in use when the phase was first entered
+        uint32_t heap_peak;
+        uint32_t stack_peak;
+        uint32_t failed;
+        uint32_t failed_size;       // last failed allocation
+        void *failed_caller;
+        mem_site_t top[MEM_PROFILE_TOP];
+    } mem_phase_record_t;
+
+    // Runs in the context of the allocation, with the mem-trace lock held, so must not allocate (or print)
+    static void trace_cb(uint8_t op, void *res, void *caller, ...) {
+        MemProfile *self = _instance;
+
+        va_list va;
+        va_start(va, caller);
+
+        switch (op) {
+            case MBED_MEM_TRACE_MALLOC:
+                self->on_alloc(res, va_arg(va, size_t), caller);
+                break;
+
+            case MBED_MEM_TRACE_CALLOC: {
+                size_t num = va_arg(va, size_t);
+                size_t size = va_arg(va, size_t);
+                self->on_alloc(res, num * size, caller);
+                break;
+            }
+
+            case MBED_MEM_TRACE_REALLOC: {
+                void *ptr = va_arg(va, void*);
+                size_t size = va_arg(va, size_t);
+                // a failed realloc leaves the old block in place
+                if (res) {
+                    self->on_free(ptr);
+                }
+                self->on_alloc(res, size, caller);
+                break;
+            }
+
+            case MBED_MEM_TRACE_FREE:
+                self->on_free(va_arg(va, void*));
+                break;
+        }
+
+        va_end(va);
+    }
+
+    void on_alloc(void *ptr, size_t size, void *caller) {
+        mem_phase_record_t *record = &_phases[_phase];
+
+        if (!ptr) {
+            if (size == 0) return;
+            record->failed++;
+            record->failed_size = size;
+            record->failed_caller = caller;
+            return;
+        }
+
+        mem_allocation_t *allocation = NULL;
+        for (size_t ix = 0; ix < MBED_CONF_APP_MEM_PROFILE_ALLOCATIONS; ix++) {
+            if (_allocations[ix].ptr == NULL) {
+                allocation = &_allocations[ix];
+                break;
+            }
+        }
+
+        if (allocation) {
+            uint8_t site = site_for(caller);
+            allocation->ptr = ptr;
+            allocation->size = size;
+            allocation->site = site;
+            _sites[site].bytes += size;
+            _sites[site].count++;
+        }
+        else {
+            _untracked++;
+        }
+
+        mbed_stats_heap_t heap;
+        mbed_stats_heap_get(&heap);
+        if (heap.current_size > record->heap_peak) {
+            record->heap_peak = heap.current_size;
+            take_top(record);
+        }
+    }
+
+    void on_free(void *ptr) {
+        if (!ptr) return;
+
+        for (size_t ix = 0; ix < MBED_CONF_APP_MEM_PROFILE_ALLOCATIONS; ix++) {
+            if (_allocations[ix].ptr != ptr) continue;
+
+            mem_site_t *site = &_sites[_allocations[ix].site];
+            site->bytes -= _allocations[ix].size;
+            site->count--;
+            _allocations[ix].ptr = NULL;
+            return;
+        }
+    }
+
+    // Site for a call site, a site without live allocations is taken over by a new call site
+    uint8_t site_for(void *caller) {
+        const uint8_t other = MBED_CONF_APP_MEM_PROFILE_SITES - 1;
+
+        uint8_t empty = other;
+        for (uint8_t ix = 0; ix < other; ix++) {
+            if (_sites[ix].caller == caller) return ix;
+            if (empty == other && _sites[ix].count == 0) {
+                empty = ix;
+            }
+        }
+
+        if (empty != other) {
+            _sites[empty].caller = caller;
+        }
+        return empty;
+    }
+
+    void take_top(mem_phase_record_t *record) {
+        memset(record->top, 0, sizeof(record->top));
+
+        for (uint8_t ix = 0; ix < MBED_CONF_APP_MEM_PROFILE_SITES; ix++) {
+            if (_sites[ix].count == 0) continue;
+
+            // insertion into the (short) sorted list
+            int8_t pos = MEM_PROFILE_TOP;
+            while (pos > 0 && record->top[pos - 1].bytes < _sites[ix].bytes) {
+                pos--;
+            }
+            if (pos == MEM_PROFILE_TOP) continue;
+
+            memmove(&record->top[pos + 1], &record->top[pos], (MEM_PROFILE_TOP - pos - 1) * sizeof(mem_site_t));
+            record->top[pos] = _sites[ix];
+        }
+    }
+
+    void sample_stack() {
+#if MEM_PROFILE_STACK
+        if (!_thread) return;
+
+        uint32_t used = osThreadGetStackSize(_thread) - osThreadGetStackSpace(_thread);
+        if (used > _phases[_phase].stack_peak) {
+            _phases[_phase].stack_peak = used;
+        }
+#endif
+    }
+
+    // Paint the unused part of the stack with the fill pattern again, only possible from the thread itself
+    void reset_stack() {
+#if MEM_PROFILE_STACK
+        if (osThreadGetId() != _thread) return;
+
+        osRtxThread_t *thread = static_cast<osRtxThread_t*>(_thread);
+        volatile uint32_t marker = 0;
+
+        // the first word holds the magic word that RTX checks for stack overflows
+        uint32_t *word = static_cast<uint32_t*>(thread->stack_mem) + 1;
+        uint32_t *end = const_cast<uint32_t*>(&marker) - MEM_PROFILE_STACK_MARGIN;
+        while (word < end) {
+            *word++ = osRtxStackFillPattern;
+        }
+#endif
+    }
+
+    static MemProfile *_instance;
+
+    mem_phase_t _phase;
+    uint32_t _untracked;            // allocations that did not fit in the table
+    bd_size_t _read_since_program;
+#if MEM_PROFILE_STACK
+    osThreadId_t _thread;
+#endif
+    mem_phase_record_t _phases[MEM_PHASE_COUNT];
+    mem_allocation_t _allocations[MBED_CONF_APP_MEM_PROFILE_ALLOCATIONS];
+    mem_site_t _sites[MBED_CONF_APP_MEM_PROFILE_SITES];
+};
+
+MemProfile *MemProfile::_instance = NULL;
+
+/**
+ * Block device wrapper that tells the profile when the update client starts and stops writing after the
+ * fragmentation session completed, which separates applying a delta update from verifying the image
+ */
+class MemProfileBlockDevice : public BlockDevice {
+public:
+    MemProfileBlockDevice(BlockDevice *bd, MemProfile *profile) : _bd(bd), _profile(profile) {
+    }
+
+    virtual int init() { return _bd->init(); }
+    virtual int deinit() { return _bd->deinit(); }
+    virtual int sync() { return _bd->sync(); }
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) {
+        _profile->on_read(size);
+        return _bd->read(buffer, addr, size);
+    }
+
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+        _profile->on_program();
+        return _bd->program(buffer, addr, size);
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) { return _bd->erase(addr, size); }
+
+    virtual bd_size_t get_read_size() const { return _bd->get_read_size(); }
+    virtual bd_size_t get_program_size() const { return _bd->get_program_size(); }
+    virtual bd_size_t get_erase_size() const { return _bd->get_erase_size(); }
+    virtual int get_erase_value() const { return _bd->get_erase_value(); }
+    virtual bd_size_t size() const { return _bd->size(); }
+
+private:
+    BlockDevice *_bd;
+    MemProfile *_profile;
+};
+
+#endif // MBED_CONF_APP_MEM_PROFILE
+
 #endif // _MEMORY_HELPER_H
@@ -0,0 +1,297 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_RX_LATENCY_HELPER_H
+#define _LORAWAN_FUOTA_RX_LATENCY_HELPER_H
+
+#include "mbed.h"
+
+// Histogram bucket b holds samples below 2^(b+1) us, the last bucket holds everything from 2^19 us (~0.5 s) up
+#define RX_LATENCY_BUCKETS              20
+
+#define RX_LATENCY_UPLINK_VERSION       1
+#define RX_LATENCY_UPLINK_LENGTH        (1 + RX_STAGE_COUNT * 6)
+
+typedef enum {
+    RX_STAGE_RECEIVE    = 0,    // RX_DONE until the downlink is copied out of the LoRaWAN stack
+    RX_STAGE_FEC        = 1,    // update client handling a DATA_FRAGMENT, without block device time
+    RX_STAGE_FLASH      = 2,    // block device time while handling a DATA_FRAGMENT
+    RX_STAGE_TOTAL      = 3,    // RX_DONE until the downlink is handled
+    RX_STAGE_COUNT      = 4
+} rx_stage_t;
+
+static const char *rx_stage_names[RX_STAGE_COUNT] = { "receive", "fec", "flash", "total" };
+
+/**
+ * Block device wrapper that accounts how long is spent in the underlying block device.
+ * Cheaper than the benchmark's block device wrapper, so it can stay in production builds.
+ */
+class TimedBlockDevice : public BlockDevice {
+public:
+    TimedBlockDevice(BlockDevice *bd) : busy_us(0), _bd(bd) {
+    }
+
+    virtual int init() { return _bd->init(); }
+    virtual int deinit() { return _bd->deinit(); }
+    virtual int sync() { return _bd->sync(); }
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) {
+        uint32_t start = us_ticker_read();
+        int r = _bd->read(buffer, addr, size);
+        busy_us += us_ticker_read() - start;
+        return r;
+    }
+
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+        uint32_t start = us_ticker_read();
+        int r = _bd->program(buffer, addr, size);
+        busy_us += us_ticker_read() - start;
+        return r;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        uint32_t start = us_ticker_read();
+        int r = _bd->erase(addr, size);
+        busy_us += us_ticker_read() - start;
+        return r;
+    }
+
+    virtual bd_size_t get_read_size() const { return _bd->get_read_size(); }
+    virtual bd_size_t get_program_size() const { return _bd->get_program_size(); }
+    virtual bd_size_t get_erase_size() const { return _bd->get_erase_size(); }
+    virtual int get_erase_value() const { return _bd->get_erase_value(); }
+    virtual bd_size_t size() const { return _bd->size(); }
+
+    uint32_t busy_us;
+
+private:
+    BlockDevice *_bd;
+};
+
+/**
+ * Per stage latency histograms for the downlink path, in fixed RAM (~250 bytes).
+ * Keeps exact count, min, max and sum per stage, percentiles come from log2 buckets
+ * (so they're an upper bound, at most 2x the real value).
+ */
+class RxLatency {
+public:
+    RxLatency() : _rx_done_at(0), _in_downlink(false), _queue(NULL), _console_scheduled(false) {
+        reset();
+    }
+
+    static uint32_t now_us() {
+        return us_ticker_read();
+    }
+
+    /**
+     * Answer queries on the serial port ('l' prints the stats, 'r' resets them).
+     * The console is only read when it signals input (sigio), which needs platform.stdio-buffered-serial.
+     */
+    void start(EventQueue *queue) {
+        _queue = queue;
+#if !defined(TARGET_SIMULATOR)
+        FileHandle *console = mbed_file_handle(STDIN_FILENO);
+        if (console) {
+            console->sigio(callback(this, &RxLatency::console_sigio));
+        }
+#endif
+    }
+
+    void reset() {
+        memset(_stages, 0, sizeof(_stages));
+        for (uint8_t ix = 0; ix < RX_STAGE_COUNT; ix++) {
+            _stages[ix].min_us = 0xffffffff;
+        }
+    }
+
+    /**
+     * Call on RX_DONE, before the downlink is read from the stack
+     */
+    void rx_done() {
+        _rx_done_at = now_us();
+        _in_downlink = true;
+    }
+
+    /**
+     * Call when the downlink was copied out of the stack
+     */
+    void received() {
+        if (_in_downlink) record(RX_STAGE_RECEIVE, now_us() - _rx_done_at);
+    }
+
+    /**
+     * Call when the downlink was handled
+     */
+    void handled() {
+        if (_in_downlink) record(RX_STAGE_TOTAL, now_us() - _rx_done_at);
+        _in_downlink = false;
+    }
+
+    /**
+     * Record a DATA_FRAGMENT that the update client handled
+     *
+     * @param uc_us     Time spent in the update client
+     * @param bd_us     Of which in the block device
+     */
+    void fragment(uint32_t uc_us, uint32_t bd_us) {
+        record(RX_STAGE_FEC, uc_us > bd_us ? uc_us - bd_us : 0);
+        record(RX_STAGE_FLASH, bd_us);
+    }
+
+    void record(rx_stage_t stage, uint32_t us) {
+        stage_t *s = &_stages[stage];
+
+        s->count++;
+        s->sum_us += us;
+        if (us < s->min_us) s->min_us = us;
+        if (us > s->max_us) s->max_us = us;
+
+        uint16_t *bucket = &s->buckets[bucket_for(us)];
+        if (*bucket != 0xffff) (*bucket)++;
+    }
+
+    /**
+     * Percentile of a stage, from the histogram
+     *
+     * @returns Upper bound of the bucket that the percentile falls in (capped at the max), in us
+     */
+    uint32_t percentile_us(rx_stage_t stage, uint8_t percent) const {
+        const stage_t *s = &_stages[stage];
+        uint8_t b = percentile_bucket(stage, percent);
+        if (b >= RX_LATENCY_BUCKETS - 1) return s->max_us;
+
+        uint32_t upper = (1UL << (b + 1)) - 1;
+        return upper < s->max_us ? upper : s->max_us;
+    }
+
+    void print() const {
+        printf("RX latency (us):     count      min      p50      p90      p99      max      avg\n");
+        for (uint8_t ix = 0; ix < RX_STAGE_COUNT; ix++) {
+            const stage_t *s = &_stages[ix];
+            rx_stage_t stage = static_cast<rx_stage_t>(ix);
+
+            if (s->count == 0) {
+                printf("RX latency %-8s %10d\n", rx_stage_names[ix], 0);
+                continue;
+            }
+
+            printf("RX latency %-8s %10lu %8lu %8lu %8lu %8lu %8lu %8lu\n", rx_stage_names[ix], s->count, s->min_us,
+                percentile_us(stage, 50), percentile_us(stage, 90), percentile_us(stage, 99), s->max_us,
+                static_cast<uint32_t>(s->sum_us / s->count));
+        }
+    }
+
+    /**
+     * Compact version of the stats to send as an uplink (decoded by fuota-server/rx-latency.js)
+     * Version byte, then per stage: count (uint16), p50 bucket, p99 bucket, max in 0.1 ms (uint16)
+     *
+     * @returns Length of the message (RX_LATENCY_UPLINK_LENGTH)
+     */
+    size_t encode(uint8_t *buffer) const {
+        uint8_t *p = buffer;
+        *p++ = RX_LATENCY_UPLINK_VERSION;
+
+        for (uint8_t ix = 0; ix < RX_STAGE_COUNT; ix++) {
+            const stage_t *s = &_stages[ix];
+            rx_stage_t stage = static_cast<rx_stage_t>(ix);
+
+            uint16_t count = s->count > 0xffff ? 0xffff : s->count;
+            uint32_t max = s->max_us / 100;
+            if (max > 0xffff) max = 0xffff;
+
+            *p++ = count & 0xff;
+            *p++ = count >> 8;
+            *p++ = percentile_bucket(stage, 50);
+            *p++ = percentile_bucket(stage, 99);
+            *p++ = max & 0xff;
+            *p++ = max >> 8;
+        }
+
+        return p - buffer;
+    }
+
+private:
+    typedef struct {
+        uint32_t count;
+        uint32_t min_us;
+        uint32_t max_us;
+        uint64_t sum_us;
+        uint16_t buckets[RX_LATENCY_BUCKETS];
+    } stage_t;
+
+    static uint8_t bucket_for(uint32_t us) {
+        uint8_t b = 0;
+        while (us > 1 && b < RX_LATENCY_BUCKETS - 1) {
+            us >>= 1;
+            b++;
+        }
+        return b;
+    }
+
+    uint8_t percentile_bucket(rx_stage_t stage, uint8_t percent) const {
+        const stage_t *s = &_stages[stage];
+
+        uint32_t total = 0;
+        for (uint8_t b = 0; b < RX_LATENCY_BUCKETS; b++) {
+            total += s->buckets[b];
+        }
+        if (total == 0) return 0;
+
+        uint32_t target = (total * percent + 99) / 100;
+        uint32_t seen = 0;
+        for (uint8_t b = 0; b < RX_LATENCY_BUCKETS; b++) {
+            seen += s->buckets[b];
+            if (seen >= target) return b;
+        }
+        return RX_LATENCY_BUCKETS - 1;
+    }
+
+#if !defined(TARGET_SIMULATOR)
+    // Runs in an ISR (also when the TX buffer drains), so only defer to the event queue, once
+    void console_sigio() {
+        if (_console_scheduled) return;
+
+        _console_scheduled = _queue->call(this, &RxLatency::read_console) != 0;
+    }
+
+    void read_console() {
+        _console_scheduled = false;
+
+        FileHandle *console = mbed_file_handle(STDIN_FILENO);
+        while (console && (console->poll(POLLIN) & POLLIN)) {
+            char c;
+            if (console->read(&c, 1) != 1) return;
+
+            if (c == 'l') {
+                print();
+            }
+            else if (c == 'r') {
+                reset();
+                printf("RX latency stats cleared\n");
+            }
+        }
+    }
+#endif
+
+    stage_t _stages[RX_STAGE_COUNT];
+    uint32_t _rx_done_at;
+    bool _in_downlink;
+    EventQueue *_queue;
+    volatile bool _console_scheduled;
+};
+
+#endif // _LORAWAN_FUOTA_RX_LATENCY_HELPER_H
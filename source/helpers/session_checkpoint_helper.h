@@ -0,0 +1,298 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_SESSION_CHECKPOINT_HELPER_H
+#define _LORAWAN_FUOTA_SESSION_CHECKPOINT_HELPER_H
+
+#include "mbed.h"
+#include "frag_memory_helper.h"
+
+#define SESSION_CHECKPOINT_MAGIC        0x504b4346  // 'FCKP'
+#define SESSION_CHECKPOINT_VERSION      1
+
+// McGroupSetupReq: CID, McGroupIDHeader, McAddr (4), McKey_encrypted (16), minMcFCount (4), maxMcFCount (4)
+#define MC_GROUP_SETUP_REQ              0x02
+#define MC_GROUP_SETUP_REQ_LENGTH       30
+
+// Data fragments to replay per event when resuming
+#define SESSION_RESUME_BATCH            16
+
+#define SESSION_CHECKPOINT_BITMAP_SIZE  ((MBED_CONF_APP_SESSION_CHECKPOINT_MAX_FRAGMENTS + 7) / 8)
+
+/**
+ * Persists a fragmentation session, so it can be resumed after a reset.
+ *
+ * The update client writes every data fragment to its place in slot 0 as it comes in, so the fragments themselves
+ * are already on the block device. This keeps track of which data fragments were received (bitmap in RAM), and
+ * together with the McGroupSetupReq and FragSessionSetupReq that started the session, writes it to the block device
+ * every MBED_CONF_APP_SESSION_CHECKPOINT_INTERVAL fragments. Two copies are written in turn, so a reset while
+ * writing a checkpoint leaves the previous one intact.
+ *
+ * The parity state of the update client lives in RAM and cannot be saved, so on resume the received data fragments
+ * are replayed into a new session, and everything else comes from the parity that the server sends afterwards.
+ *
+ * The block device needs a program size of 1 (e.g. the block cache), and sync() has to flush the fragments
+ * that the update client wrote before the checkpoint is trusted.
+ */
+class SessionCheckpoint {
+public:
+    SessionCheckpoint(BlockDevice *bd, bd_addr_t addr)
+        : _bd(bd), _addr(addr), _copy_size(0), _sequence(0), _active(false), _pending(0)
+    {
+        memset(&_header, 0, sizeof(_header));
+        memset(_bitmap, 0, sizeof(_bitmap));
+    }
+
+    /**
+     * Call after the block device was initialized
+     *
+     * @returns 0 if checkpoints can be written, -1 if not
+     */
+    int init() {
+        if (_bd->get_program_size() != 1 || _bd->get_read_size() != 1) {
+            printf("Session checkpoint: block device needs a program and read size of 1 (set block-cache-page-size), disabled\n");
+            _bd = NULL;
+            return -1;
+        }
+
+        bd_size_t record_size = sizeof(header_t) + SESSION_CHECKPOINT_BITMAP_SIZE;
+        bd_size_t erase_size = _bd->get_erase_size();
+        _copy_size = ((record_size + erase_size - 1) / erase_size) * erase_size;
+
+        if (_addr % erase_size != 0 || _addr + 2 * _copy_size > _bd->size()) {
+            printf("Session checkpoint: address %llu is not erase aligned, or does not fit two copies of %llu bytes, disabled\n",
+                _addr, _copy_size);
+            _bd = NULL;
+            return -1;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Remember a McGroupSetupReq, so it can be replayed when a session is resumed
+     */
+    void set_mc_group_setup(const uint8_t *req, size_t length) {
+        if (length != MC_GROUP_SETUP_REQ_LENGTH) return;
+        memcpy(_header.mc_group_setup, req, MC_GROUP_SETUP_REQ_LENGTH);
+        _header.mc_addr = req[2] | (req[3] << 8) | (req[4] << 16) | (req[5] << 24);
+    }
+
+    /**
+     * A new fragmentation session was set up, forget the previous one.
+     * One session is tracked at a time, a session on another frag index is ignored while one is tracked.
+     */
+    void start(const uint8_t *frag_setup_req, const frag_session_setup_t &setup) {
+        if (!_bd) return;
+
+        if (_active && setup.frag_index != frag_index()) {
+            printf("Session checkpoint: already tracking FragSession %u, FragSession %u cannot be resumed\n",
+                frag_index(), setup.frag_index);
+            return;
+        }
+
+        clear();
+
+        if (setup.nb_frag > MBED_CONF_APP_SESSION_CHECKPOINT_MAX_FRAGMENTS) {
+            printf("Session checkpoint: %u fragments is more than session-checkpoint-max-fragments (%d), session cannot be resumed\n",
+                setup.nb_frag, MBED_CONF_APP_SESSION_CHECKPOINT_MAX_FRAGMENTS);
+            return;
+        }
+
+        memcpy(_header.frag_setup, frag_setup_req, FRAG_SESSION_SETUP_REQ_LENGTH);
+        _header.nb_frag = setup.nb_frag;
+        _header.frag_size = setup.frag_size;
+        _header.received = 0;
+        memset(_bitmap, 0, sizeof(_bitmap));
+        _active = true;
+    }
+
+    /**
+     * Mark a data fragment (1..nb_frag) as received
+     *
+     * @returns true if a checkpoint is due (once per interval)
+     */
+    bool mark(uint8_t frag_index, uint16_t n) {
+        if (!is_tracking(frag_index) || n == 0 || n > _header.nb_frag) return false;
+
+        uint8_t mask = 1 << ((n - 1) % 8);
+        if (_bitmap[(n - 1) / 8] & mask) return false;
+
+        _bitmap[(n - 1) / 8] |= mask;
+        _header.received++;
+        _pending++;
+
+        return _pending == MBED_CONF_APP_SESSION_CHECKPOINT_INTERVAL;
+    }
+
+    /**
+     * Write a checkpoint (flushes the block device first)
+     */
+    int save() {
+        if (!_active) return 0;
+
+        _pending = 0;
+
+        // the fragments have to be on the block device before we claim to have them
+        int r = _bd->sync();
+        if (r != BD_ERROR_OK) return r;
+
+        _sequence++;
+        _header.magic = SESSION_CHECKPOINT_MAGIC;
+        _header.version = SESSION_CHECKPOINT_VERSION;
+        _header.sequence = _sequence;
+        _header.crc = 0;
+        _header.crc = crc();
+
+        bd_addr_t addr = copy_addr(_sequence);
+
+        r = _bd->erase(addr, _copy_size);
+        if (r != BD_ERROR_OK) return r;
+        r = _bd->program(_bitmap, addr + sizeof(header_t), bitmap_length());
+        if (r != BD_ERROR_OK) return r;
+        // header last, so a partly written copy is never valid
+        r = _bd->program(&_header, addr, sizeof(header_t));
+        if (r != BD_ERROR_OK) return r;
+        return _bd->sync();
+    }
+
+    /**
+     * Forget the session (when it completed, or when a new one starts)
+     */
+    int clear() {
+        _active = false;
+        _pending = 0;
+        if (!_bd) return -1;
+
+        header_t header;
+        for (uint8_t copy = 0; copy < 2; copy++) {
+            if (_bd->read(&header, _addr + copy * _copy_size, sizeof(header)) != BD_ERROR_OK) return -1;
+            if (header.magic != SESSION_CHECKPOINT_MAGIC) continue;
+
+            int r = _bd->erase(_addr + copy * _copy_size, _copy_size);
+            if (r != BD_ERROR_OK) return r;
+        }
+        return _bd->sync();
+    }
+
+    /**
+     * Load the latest valid checkpoint
+     *
+     * @returns true if there is a session to resume
+     */
+    bool load() {
+        if (!_bd) return false;
+
+        uint32_t best_sequence = 0;
+        for (uint8_t copy = 0; copy < 2; copy++) {
+            bd_addr_t addr = _addr + copy * _copy_size;
+
+            if (_bd->read(&_header, addr, sizeof(header_t)) != BD_ERROR_OK) continue;
+            if (_header.magic != SESSION_CHECKPOINT_MAGIC || _header.version != SESSION_CHECKPOINT_VERSION) continue;
+            if (_header.nb_frag == 0 || _header.nb_frag > MBED_CONF_APP_SESSION_CHECKPOINT_MAX_FRAGMENTS) continue;
+            if (_bd->read(_bitmap, addr + sizeof(header_t), bitmap_length()) != BD_ERROR_OK) continue;
+
+            uint32_t stored_crc = _header.crc;
+            _header.crc = 0;
+            if (crc() != stored_crc) continue;
+            _header.crc = stored_crc;
+
+            if (_header.sequence > best_sequence) {
+                best_sequence = _header.sequence;
+            }
+        }
+
+        if (best_sequence == 0) {
+            memset(&_header, 0, sizeof(_header));
+            return false;
+        }
+
+        // re-read the winner, the loop may have left the other copy in RAM
+        bd_addr_t addr = copy_addr(best_sequence);
+        if (_bd->read(&_header, addr, sizeof(header_t)) != BD_ERROR_OK) return false;
+        if (_bd->read(_bitmap, addr + sizeof(header_t), bitmap_length()) != BD_ERROR_OK) return false;
+
+        _sequence = best_sequence;
+        _active = true;
+        return true;
+    }
+
+    bool is_received(uint16_t n) const {
+        return n > 0 && n <= _header.nb_frag && (_bitmap[(n - 1) / 8] & (1 << ((n - 1) % 8)));
+    }
+
+    bool is_tracking(uint8_t frag_index) const {
+        return _active && this->frag_index() == frag_index;
+    }
+
+    uint8_t frag_index() const { return (_header.frag_setup[1] >> 4) & 0x3; }
+    const uint8_t *mc_group_setup() const { return _header.mc_group_setup; }
+    const uint8_t *frag_setup() const { return _header.frag_setup; }
+    uint32_t mc_addr() const { return _header.mc_addr; }
+    uint16_t nb_frag() const { return _header.nb_frag; }
+    uint8_t frag_size() const { return _header.frag_size; }
+    uint16_t received() const { return _header.received; }
+
+private:
+    typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t sequence;
+        uint32_t crc;           // CRC32 over the header (with this field 0) and the bitmap
+        uint32_t mc_addr;
+        uint16_t nb_frag;
+        uint16_t received;
+        uint8_t frag_size;
+        uint8_t mc_group_setup[MC_GROUP_SETUP_REQ_LENGTH];
+        uint8_t frag_setup[FRAG_SESSION_SETUP_REQ_LENGTH];
+    } header_t;
+
+    bd_addr_t copy_addr(uint32_t sequence) const {
+        return _addr + (sequence % 2) * _copy_size;
+    }
+
+    bd_size_t bitmap_length() const {
+        return (_header.nb_frag + 7) / 8;
+    }
+
+    static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t length) {
+        for (size_t ix = 0; ix < length; ix++) {
+            crc ^= data[ix];
+            for (uint8_t bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+            }
+        }
+        return crc;
+    }
+
+    uint32_t crc() const {
+        uint32_t c = crc32_update(0xffffffff, reinterpret_cast<const uint8_t*>(&_header), sizeof(header_t));
+        c = crc32_update(c, _bitmap, bitmap_length());
+        return ~c;
+    }
+
+    BlockDevice *_bd;
+    bd_addr_t _addr;
+    bd_size_t _copy_size;
+    uint32_t _sequence;
+    bool _active;
+    uint16_t _pending;
+    header_t _header;
+    uint8_t _bitmap[SESSION_CHECKPOINT_BITMAP_SIZE];
+};
+
+#endif // _LORAWAN_FUOTA_SESSION_CHECKPOINT_HELPER_H
@@ -21,9 +21,10 @@
 #include "mbed.h"
 
 #if defined(TARGET_SIMULATOR)
-// Initialize a persistent block device with 528 bytes block size, and 256 blocks (mimicks the at45, which also has 528 size blocks)
+// Initialize a persistent block device with 528 bytes block size (mimicks the at45, which also has 528 size blocks)
+// The slots end before block 301 (slot 2 firmware is blocks 201-300), the two session checkpoint copies are blocks 301 and 302
 #include "SimulatorBlockDevice.h"
-SimulatorBlockDevice bd("lorawan-frag-in-flash", 256 * 528, static_cast<uint64_t>(528));
+SimulatorBlockDevice bd("lorawan-frag-in-flash", 303 * 528, static_cast<uint64_t>(528));
 #elif defined(TARGET_FF1705_L151CC)
 // Flash interface on the L-TEK xDot shield
 #include "AT45BlockDevice.h"
@@ -0,0 +1,186 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_TRACE_LOG_HELPER_H
+#define _LORAWAN_FUOTA_TRACE_LOG_HELPER_H
+
+#include "mbed.h"
+
+/**
+ * Event IDs in the trace log. fuota-server/decode-trace.js has the same table, keep them in sync.
+ */
+typedef enum {
+    TRACE_BOOT              = 0x01,     //
+    TRACE_RX                = 0x02,     // port, -, length
+    TRACE_TX_SCHEDULED      = 0x03,     // port, -, length
+    TRACE_TX_DONE           = 0x04,     // port, -, ms queued
+    TRACE_TX_ERROR          = 0x05,     // event
+    TRACE_RX_ERROR          = 0x06,     // event
+    TRACE_FRAGMENT          = 0x07,     // frag index, N, status
+    TRACE_UC_STATUS         = 0x08,     // port, -, status
+    TRACE_CLASS_A           = 0x09,     //
+    TRACE_CLASS_C           = 0x0A,     // datarate, multicast group, frequency
+    TRACE_HEAP              = 0x0B,     // trace_heap_point_t, -, current size, followed by TRACE_HEAP_MAX
+    TRACE_HEAP_MAX          = 0x0C,     // trace_heap_point_t, -, max size
+    TRACE_FRAG_COMPLETE     = 0x0D,     // frag index
+    TRACE_NEXT_UPLINK       = 0x0E,     // datarate, -, delay in ms
+    TRACE_DROPPED           = 0x0F      // -, -, number of entries that were overwritten before they were drained
+} trace_event_t;
+
+// Where the heap stats were taken
+typedef enum {
+    TRACE_HEAP_CONNECTED    = 0,
+    TRACE_HEAP_CLASS_A      = 1,
+    TRACE_HEAP_CLASS_C      = 2
+} trace_heap_point_t;
+
+// Entries written per drain, every drain interval (while the application is idle and the ring is not empty)
+#define TRACE_LOG_DRAIN_BATCH           16
+#define TRACE_LOG_DRAIN_INTERVAL_MS     1000
+
+/**
+ * Fixed size RAM ring of timestamped events.
+ *
+ * Logging an event is a few stores, instead of a printf that blocks on the UART. The ring is drained to the serial
+ * port at idle time, as lines of the form '#T <24 hex characters>', which fuota-server/decode-trace.js turns back
+ * into text. When the ring is full, the oldest entries are overwritten and counted.
+ *
+ * A drain is only scheduled while the ring has entries and the application is idle (the idle function returns true,
+ * e.g. not in Class C). While it's busy nothing is scheduled, the device isn't woken up for the log. The application
+ * calls resume() when it becomes idle again, which drains what was logged meanwhile.
+ *
+ * Only log from the event queue thread (the ring has a single writer).
+ */
+class TraceLog {
+public:
+    TraceLog() : _head(0), _tail(0), _dropped(0), _dropped_reported(0), _queue(NULL), _idle(NULL), _drain_scheduled(false) {
+    }
+
+    /**
+     * Start draining the log on the event queue
+     *
+     * @param queue     Event queue to drain on
+     * @param idle      Returns whether the serial port can be written to without stalling the application
+     */
+    void start(EventQueue *queue, bool (*idle)()) {
+        _queue = queue;
+        _idle = idle;
+        log(TRACE_BOOT, 0, 0, 0);
+    }
+
+    void log(trace_event_t event, uint8_t arg0, uint16_t arg1, uint32_t arg2) {
+        entry_t *entry = &_entries[_head % MBED_CONF_APP_TRACE_LOG_SIZE];
+        entry->time = _queue ? _queue->tick() : 0;
+        entry->event = event;
+        entry->arg0 = arg0;
+        entry->arg1 = arg1;
+        entry->arg2 = arg2;
+
+        _head++;
+        if (_head - _tail > MBED_CONF_APP_TRACE_LOG_SIZE) {
+            _tail = _head - MBED_CONF_APP_TRACE_LOG_SIZE;
+            _dropped++;
+        }
+
+        if (!_idle || _idle()) {
+            schedule_drain();
+        }
+    }
+
+    /**
+     * The application became idle, drain what was logged while it was busy
+     */
+    void resume() {
+        schedule_drain();
+    }
+
+    /**
+     * Log the current and max. heap usage (needs MBED_HEAP_STATS_ENABLED=1)
+     */
+    void log_heap(trace_heap_point_t point) {
+#if MBED_HEAP_STATS_ENABLED
+        mbed_stats_heap_t heap_stats;
+        mbed_stats_heap_get(&heap_stats);
+        log(TRACE_HEAP, point, 0, heap_stats.current_size);
+        log(TRACE_HEAP_MAX, point, 0, heap_stats.max_size);
+#endif
+    }
+
+    /**
+     * Write up to TRACE_LOG_DRAIN_BATCH entries to the serial port when idle, schedules the next drain if entries remain.
+     * When the application became busy in the meantime, draining waits for resume().
+     */
+    void drain() {
+        _drain_scheduled = false;
+
+        if (_idle && !_idle()) {
+            return;
+        }
+
+        if (_dropped != _dropped_reported) {
+            print(_queue->tick(), TRACE_DROPPED, 0, 0, _dropped - _dropped_reported);
+            _dropped_reported = _dropped;
+        }
+
+        for (uint8_t ix = 0; ix < TRACE_LOG_DRAIN_BATCH && _tail != _head; ix++) {
+            const entry_t *entry = &_entries[_tail % MBED_CONF_APP_TRACE_LOG_SIZE];
+            print(entry->time, entry->event, entry->arg0, entry->arg1, entry->arg2);
+            _tail++;
+        }
+
+        schedule_drain();
+    }
+
+private:
+    typedef struct {
+        uint32_t time;
+        uint8_t event;
+        uint8_t arg0;
+        uint16_t arg1;
+        uint32_t arg2;
+    } entry_t;
+
+    void schedule_drain() {
+        if (!_queue || _drain_scheduled || _tail == _head) return;
+
+        _drain_scheduled = _queue->call_in(TRACE_LOG_DRAIN_INTERVAL_MS, this, &TraceLog::drain) != 0;
+    }
+
+    static void print(uint32_t time, uint8_t event, uint8_t arg0, uint16_t arg1, uint32_t arg2) {
+        printf("#T %08lx%02x%02x%04x%08lx\n", time, event, arg0, arg1, arg2);
+    }
+
+    entry_t _entries[MBED_CONF_APP_TRACE_LOG_SIZE];
+    uint32_t _head;
+    uint32_t _tail;
+    uint32_t _dropped;
+    uint32_t _dropped_reported;
+    EventQueue *_queue;
+    bool (*_idle)();
+    bool _drain_scheduled;
+};
+
+#if MBED_CONF_APP_TRACE_LOG
+static TraceLog trace_log;
+
+// log an event, or (without the trace log) print the message
+#define TRACE_LOG(event, arg0, arg1, arg2, ...)     trace_log.log(event, arg0, arg1, arg2)
+#else
+#define TRACE_LOG(event, arg0, arg1, arg2, ...)     printf(__VA_ARGS__)
+#endif
+
+#endif // _LORAWAN_FUOTA_TRACE_LOG_HELPER_H
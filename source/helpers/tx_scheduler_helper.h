@@ -0,0 +1,184 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_TX_SCHEDULER_HELPER_H
+#define _LORAWAN_FUOTA_TX_SCHEDULER_HELPER_H
+
+#include "mbed.h"
+
+// MHDR (1) + FHDR without FOpts (7) + FPort (1) + MIC (4)
+#define LORAWAN_FRAME_OVERHEAD      13
+
+// RX2 opens 2 seconds after the end of the uplink, plus some slack for the RX2 window itself
+#define LORAWAN_RX2_DELAY_MS        2000
+#define LORAWAN_RX2_WINDOW_MS       500
+
+#define TX_SCHEDULER_BAND_COUNT     6
+
+/**
+ * Time on air of a LoRaWAN frame, in ms
+ * Uses the EU868 data rate table (DR0..DR5 = SF12..SF7 at 125 kHz, DR6 = SF7 at 250 kHz), coding rate 4/5,
+ * 8 preamble symbols, explicit header and CRC on.
+ *
+ * @param datarate          Data rate of the uplink
+ * @param payload_length    Application payload length (LoRaWAN frame overhead is added)
+ */
+static uint32_t lora_time_on_air_ms(uint8_t datarate, size_t payload_length) {
+    int32_t sf = datarate > 5 ? 7 : 12 - datarate;
+    uint32_t bw = datarate == 6 ? 250000 : 125000;
+    int32_t de = (bw == 125000 && sf >= 11) ? 1 : 0;   // low data rate optimization
+    int32_t pl = static_cast<int32_t>(payload_length) + LORAWAN_FRAME_OVERHEAD;
+
+    uint32_t tsym_us = (static_cast<uint32_t>(1) << sf) * 1000000UL / bw;
+
+    int32_t num = 8 * pl - 4 * sf + 28 + 16;
+    int32_t den = 4 * (sf - 2 * de);
+    int32_t payload_symbols = 8;
+    if (num > 0) {
+        payload_symbols += ((num + den - 1) / den) * (1 + 4);
+    }
+
+    // 8 preamble symbols + 4.25 sync symbols
+    uint32_t preamble_us = tsym_us * 49 / 4;
+
+    return (preamble_us + payload_symbols * tsym_us + 999) / 1000;
+}
+
+/**
+ * Tracks the EU868 duty cycle bands, and predicts when the next uplink can go out.
+ * The LoRaWAN stack enforces the duty cycle itself, this is used to schedule sends at the moment the stack allows them,
+ * rather than polling with a fixed back-off.
+ */
+class TxScheduler {
+public:
+    // a band is only taken into account once an uplink went out on it
+    TxScheduler() : _datarate(0), _bands_in_use(0), _last_send_at(0), _last_send_toa(0), _next_tx_toa(0) {
+        memset(_available_at, 0, sizeof(_available_at));
+    }
+
+    /**
+     * A message was handed to the LoRaWAN stack
+     *
+     * @param now               Current time in ms
+     * @param payload_length    Application payload length
+     */
+    void on_send(uint32_t now, size_t payload_length) {
+        _last_send_at = now;
+        _last_send_toa = lora_time_on_air_ms(_datarate, payload_length);
+    }
+
+    /**
+     * The LoRaWAN stack reported TX_DONE (this comes after the receive windows)
+     *
+     * @param now           Current time in ms
+     * @param frequency     Channel frequency that was used (Hz), 0 if not known
+     * @param datarate      Data rate that was used
+     * @param toa           Time on air that the stack reported, in ms
+     */
+    void on_tx_done(uint32_t now, uint32_t frequency, uint8_t datarate, uint32_t toa) {
+        _datarate = datarate;
+
+        int8_t band = band_for_frequency(frequency);
+        if (band < 0) return;
+
+        _bands_in_use |= (1 << band);
+
+        // upper bound for when the transmission started
+        uint32_t tx_start = now - toa - LORAWAN_RX2_DELAY_MS;
+        _available_at[band] = tx_start + toa * duty_cycle_factor(band);
+    }
+
+    /**
+     * Time (in ms) until the next uplink of payload_length bytes is allowed
+     *
+     * @param now               Current time in ms
+     * @param payload_length    Application payload length
+     */
+    uint32_t next_tx_in(uint32_t now, size_t payload_length) {
+        bool found = false;
+        uint32_t earliest = now;
+
+        for (uint8_t band = 0; band < TX_SCHEDULER_BAND_COUNT; band++) {
+            if (!(_bands_in_use & (1 << band))) continue;
+
+            uint32_t at = _available_at[band];
+            if (static_cast<int32_t>(at - now) < 0) {
+                at = now;
+            }
+            if (!found || static_cast<int32_t>(at - earliest) < 0) {
+                earliest = at;
+                found = true;
+            }
+        }
+
+        _next_tx_toa = lora_time_on_air_ms(_datarate, payload_length);
+        return earliest - now;
+    }
+
+    /**
+     * Time (in ms) until the receive windows of the last uplink have closed
+     */
+    uint32_t rx_windows_closed_in(uint32_t now) const {
+        uint32_t closed_at = _last_send_at + _last_send_toa + LORAWAN_RX2_DELAY_MS + LORAWAN_RX2_WINDOW_MS;
+        if (static_cast<int32_t>(closed_at - now) < 0) {
+            return 0;
+        }
+        return closed_at - now;
+    }
+
+    /**
+     * Predicted time on air for the next uplink (in ms)
+     */
+    uint32_t get_next_tx_toa() const {
+        return _next_tx_toa;
+    }
+
+    uint8_t get_datarate() const {
+        return _datarate;
+    }
+
+private:
+    // Band plan of LoRaPHYEU868, -1 for a frequency outside of it
+    static int8_t band_for_frequency(uint32_t frequency) {
+        if (frequency >= 865000000 && frequency <= 868000000) return 0;
+        if (frequency >= 868100000 && frequency <= 868600000) return 1;
+        if (frequency >= 868700000 && frequency <= 869200000) return 2;
+        if (frequency >= 869400000 && frequency <= 869650000) return 3;
+        if (frequency >= 869700000 && frequency <= 870000000) return 4;
+        if (frequency >= 863000000 && frequency < 865000000) return 5;
+        return -1;
+    }
+
+    // Off time is time on air times this factor (e.g. 100 for 1%)
+    static uint32_t duty_cycle_factor(uint8_t band) {
+#if MBED_CONF_LORA_DUTY_CYCLE_ON
+        static const uint16_t factors[TX_SCHEDULER_BAND_COUNT] = { 100, 100, 1000, 10, 100, 1000 };
+        return factors[band];
+#else
+        return 1;
+#endif
+    }
+
+    uint8_t _datarate;
+    uint8_t _bands_in_use;
+    uint32_t _available_at[TX_SCHEDULER_BAND_COUNT];
+    uint32_t _last_send_at;
+    uint32_t _last_send_toa;
+    uint32_t _next_tx_toa;
+};
+
+#endif // _LORAWAN_FUOTA_TX_SCHEDULER_HELPER_H
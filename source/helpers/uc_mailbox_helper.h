@@ -0,0 +1,241 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_UC_MAILBOX_HELPER_H
+#define _LORAWAN_FUOTA_UC_MAILBOX_HELPER_H
+
+#include "mbed.h"
+#include "LoRaWANUpdateClient.h"
+
+// Multicast groups in Remote Multicast Setup v1.0.0 (McGroupID is 2 bits)
+#define MC_GROUPS_MAX                   4
+
+// While a Class C session is scheduled or running, a drain that could not be posted is retried this often
+#define UC_MAILBOX_RETRY_INTERVAL_MS    1000
+
+typedef enum {
+    UC_EVENT_SWITCH_TO_CLASS_A = 0,
+    UC_EVENT_SWITCH_TO_CLASS_C,
+    UC_EVENT_FRAG_SESSION_COMPLETE,
+    UC_EVENT_FIRMWARE_READY,
+    UC_EVENT_COUNT
+} uc_event_t;
+
+/**
+ * Hands update client callbacks (some of which run in an ISR) over to the event queue, without critical sections.
+ *
+ * The drain callback is bound into an Event once in start(), a post hands that event to the queue, and at most
+ * one drain is outstanding at a time. Event::post() still takes a block from the queue's pool, so it fails when
+ * the queue is full.
+ *
+ * Every event has a post counter (written by the producer) and a handled counter (written by the event queue).
+ * An event is pending while the two differ, so a post is never lost, even if no drain event could be scheduled:
+ * it's picked up by the next post, by drain_if_pending(), or by the retry event. The application arms the retry
+ * (from the event queue, while there's room) as soon as it expects callbacks from the update client's timers,
+ * i.e. when a Class C session is scheduled, and disarms it when the last window closed. So a lost post of
+ * switchToClassA can't leave the device in Class C, and the device is not woken up while nothing is expected.
+ *
+ * Every post of UC_EVENT_SWITCH_TO_CLASS_A is taken separately: the update client closes one window (one group) per
+ * call, without saying which, so two closes must not merge into one. Repeated posts of the other events before they
+ * are taken are coalesced into one, which is ordered by its latest post (the last state wins).
+ * Class C sessions are published per multicast group with a sequence counter: odd while it's being written,
+ * readers retry on a change. Sessions for different groups that are posted before the mailbox is drained are all kept.
+ */
+class UpdateClientMailbox {
+public:
+    UpdateClientMailbox() : _queue(NULL), _drain(NULL), _drain_event(NULL), _retry_id(0), _order(0), _drain_scheduled(0), _firmware_crc(0) {
+        memset((void*)_posted, 0, sizeof(_posted));
+        memset((void*)_posted_order, 0, sizeof(_posted_order));
+        memset(_handled, 0, sizeof(_handled));
+        memset((void*)_session_seq, 0, sizeof(_session_seq));
+        memset(_session_handled, 0, sizeof(_session_handled));
+    }
+
+    /**
+     * Start the mailbox
+     *
+     * @param queue     Event queue that handles the events
+     * @param drain     Function that calls take() until the mailbox is empty, runs on the event queue
+     * @returns         0 if successful
+     */
+    int start(EventQueue *queue, void (*drain)()) {
+        _queue = queue;
+        _drain = drain;
+        _drain_event = new Event<void()>(queue->event(drain));
+
+        return _drain_event ? 0 : -1;
+    }
+
+    /**
+     * Post an event, safe to call from an ISR
+     */
+    void post(uc_event_t event) {
+        _posted_order[event] = core_util_atomic_incr_u32(&_order, 1);
+        __DMB();
+        core_util_atomic_incr_u32(&_posted[event], 1);
+
+        uint8_t not_scheduled = 0;
+        if (core_util_atomic_cas_u8(&_drain_scheduled, &not_scheduled, 1)) {
+            if (_drain_event->post() == 0) {
+                // queue is full, stays pending until the next post or drain_if_pending()
+                _drain_scheduled = 0;
+            }
+        }
+    }
+
+    /**
+     * Drain the mailbox if an event is pending but no drain is scheduled (it could not be posted), call from the event queue only
+     */
+    void drain_if_pending() {
+        if (_drain_scheduled) return;
+
+        for (uint8_t ix = 0; ix < UC_EVENT_COUNT; ix++) {
+            if (_posted[ix] != _handled[ix]) {
+                _drain();
+                return;
+            }
+        }
+    }
+
+    /**
+     * Retry draining every UC_MAILBOX_RETRY_INTERVAL_MS until disarm_retry(), call from the event queue only
+     *
+     * @returns true if the retry is armed
+     */
+    bool arm_retry() {
+        if (_retry_id == 0) {
+            _retry_id = _queue->call_every(UC_MAILBOX_RETRY_INTERVAL_MS, this, &UpdateClientMailbox::drain_if_pending);
+        }
+        return _retry_id != 0;
+    }
+
+    void disarm_retry() {
+        if (_retry_id == 0) return;
+
+        _queue->cancel(_retry_id);
+        _retry_id = 0;
+    }
+
+    /**
+     * Publish a new Class C session for its multicast group and post UC_EVENT_SWITCH_TO_CLASS_C, safe to call from an ISR.
+     * Only one context (the update client's Class C timer) may call this.
+     */
+    void post_class_c(const LoRaWANUpdateClientClassCSession_t *session) {
+        uint8_t group = session->mcGroupIDHeader & (MC_GROUPS_MAX - 1);
+
+        _session_seq[group]++;
+        __DMB();
+        memcpy((void*)&_sessions[group], session, sizeof(LoRaWANUpdateClientClassCSession_t));
+        __DMB();
+        _session_seq[group]++;
+
+        post(UC_EVENT_SWITCH_TO_CLASS_C);
+    }
+
+    /**
+     * Post UC_EVENT_FIRMWARE_READY with the CRC32 of the file (interop testing)
+     */
+    void post_firmware_ready(uint32_t crc) {
+        _firmware_crc = crc;
+        __DMB();
+        post(UC_EVENT_FIRMWARE_READY);
+    }
+
+    /**
+     * Take the oldest pending event, call from the event queue only.
+     * Multiple posts of the same event before it's taken are handled once, in the order of the latest post,
+     * except for UC_EVENT_SWITCH_TO_CLASS_A, which is taken once per post.
+     *
+     * @returns true if an event was pending
+     */
+    bool take(uc_event_t *event) {
+        // cleared before looking at the counters, so a post during the drain schedules a new one
+        _drain_scheduled = 0;
+        __DMB();
+
+        bool found = false;
+        uint32_t oldest = 0;
+
+        for (uint8_t ix = 0; ix < UC_EVENT_COUNT; ix++) {
+            if (_posted[ix] == _handled[ix]) continue;
+
+            uint32_t order = _posted_order[ix];
+            if (!found || static_cast<int32_t>(order - oldest) < 0) {
+                *event = static_cast<uc_event_t>(ix);
+                oldest = order;
+                found = true;
+            }
+        }
+
+        if (found) {
+            if (*event == UC_EVENT_SWITCH_TO_CLASS_A) {
+                _handled[*event]++;
+            }
+            else {
+                _handled[*event] = _posted[*event];
+            }
+        }
+        return found;
+    }
+
+    /**
+     * Read a Class C session that was published since the last call, call from the event queue only
+     * (after taking UC_EVENT_SWITCH_TO_CLASS_C, until it returns false)
+     *
+     * @returns true if a session was read
+     */
+    bool read_class_c_session(LoRaWANUpdateClientClassCSession_t *session) {
+        for (uint8_t group = 0; group < MC_GROUPS_MAX; group++) {
+            uint32_t seq;
+            do {
+                seq = _session_seq[group];
+                __DMB();
+                memcpy(session, (const void*)&_sessions[group], sizeof(LoRaWANUpdateClientClassCSession_t));
+                __DMB();
+            } while ((seq & 1) || seq != _session_seq[group]);
+
+            if (seq == _session_handled[group]) continue;
+
+            _session_handled[group] = seq;
+            return true;
+        }
+        return false;
+    }
+
+    uint32_t get_firmware_crc() const {
+        return _firmware_crc;
+    }
+
+private:
+    EventQueue *_queue;
+    void (*_drain)();
+    Event<void()> *_drain_event;
+    int _retry_id;
+
+    volatile uint32_t _order;
+    volatile uint32_t _posted[UC_EVENT_COUNT];
+    volatile uint32_t _posted_order[UC_EVENT_COUNT];
+    uint32_t _handled[UC_EVENT_COUNT];
+    volatile uint8_t _drain_scheduled;
+
+    volatile uint32_t _session_seq[MC_GROUPS_MAX];
+    uint32_t _session_handled[MC_GROUPS_MAX];
+    volatile LoRaWANUpdateClientClassCSession_t _sessions[MC_GROUPS_MAX];
+    volatile uint32_t _firmware_crc;
+};
+
+#endif // _LORAWAN_FUOTA_UC_MAILBOX_HELPER_H
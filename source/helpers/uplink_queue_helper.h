@@ -0,0 +1,274 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LORAWAN_FUOTA_UPLINK_QUEUE_HELPER_H
+#define _LORAWAN_FUOTA_UPLINK_QUEUE_HELPER_H
+
+#include "mbed.h"
+#include "mbed_trace.h"
+#include "LoRaWANUpdateClient.h"
+#include "frag_memory_helper.h"
+
+#define FRAG_SESSION_DELETE_ANS         0x03
+#define MC_GROUP_SETUP_ANS              0x02
+
+enum uplink_priority_t {
+    UPLINK_PRIORITY_HIGH = 0,       // time critical answers (clock sync, McClassCSessionAns, FragSessionStatusAns)
+    UPLINK_PRIORITY_NORMAL = 1,     // other update client answers
+    UPLINK_PRIORITY_LOW = 2         // application data
+};
+
+/**
+ * Determine the priority of an uplink based on its port and command ID
+ */
+static uplink_priority_t uplink_priority_for(uint8_t port, const uint8_t *data, size_t length) {
+    if (port == 202) return UPLINK_PRIORITY_HIGH;                                   // clock sync
+    if (port == 200 && length > 0 && data[0] == MC_CLASSC_SESSION_ANS) return UPLINK_PRIORITY_HIGH;
+    if (port == 201 && length > 0 && data[0] == FRAG_SESSION_STATUS_ANS) return UPLINK_PRIORITY_HIGH;
+    if (port >= 200 && port <= 202) return UPLINK_PRIORITY_NORMAL;
+    return UPLINK_PRIORITY_LOW;
+}
+
+/**
+ * Key of an uplink for replacing queued messages: the command ID, plus the fragmentation session or multicast group
+ * the answer is about (+1, 0 means none). Answers about different sessions or groups are all kept.
+ */
+static uint16_t uplink_command_key(uint8_t port, const uint8_t *data, size_t length) {
+    uint16_t key = data[0];
+
+    if (port == 201 && data[0] == FRAG_SESSION_STATUS_ANS && length >= 3) {
+        key |= ((data[2] >> 6) + 1) << 8;       // FragIndex, bits 15:14 of ReceivedAndIndex
+    }
+    else if (port == 201 && data[0] == FRAG_SESSION_SETUP_ANS && length >= 2) {
+        key |= ((data[1] >> 6) + 1) << 8;       // FragIndex, bits 7:6 of StatusBitMask
+    }
+    else if (port == 201 && data[0] == FRAG_SESSION_DELETE_ANS && length >= 2) {
+        key |= ((data[1] & 0x3) + 1) << 8;      // FragIndex, bits 1:0 of Status
+    }
+    else if (port == 200 && data[0] >= MC_GROUP_SETUP_ANS && data[0] <= MC_CLASSC_SESSION_ANS && length >= 2) {
+        key |= ((data[1] & 0x3) + 1) << 8;      // McGroupID, bits 1:0 (McGroupSetupAns, McGroupDeleteAns, McClassCSessionAns)
+    }
+
+    return key;
+}
+
+/**
+ * Statically allocated queue of pending uplinks.
+ * Messages are ordered by priority, then by the order in which they were queued.
+ * A message with the same port and command key (see uplink_command_key()) as a message that is already queued
+ * replaces that message.
+ */
+class UplinkQueue {
+public:
+    typedef struct {
+        bool in_use;
+        bool in_flight;                 // handed to the LoRaWAN stack, waiting for TX_DONE
+        bool confirmed;
+        uint8_t port;
+        uint8_t priority;
+        uint8_t retries_left;
+        uint8_t length;
+        uint32_t sequence;
+        uint32_t queued_at;             // in ms, as passed into push()
+        uint8_t data[MBED_CONF_APP_UPLINK_QUEUE_MAX_PAYLOAD];
+    } entry_t;
+
+    UplinkQueue() : _sequence(0) {
+        clear();
+    }
+
+    /**
+     * Queue a message
+     *
+     * @param port          Port to send the message on
+     * @param data          Payload, this is copied into the queue
+     * @param length        Length of the payload
+     * @param confirmed     Whether to send as confirmed message
+     * @param retries       Number of times the message is re-sent if transmission fails
+     * @param priority      Priority of the message (see uplink_priority_t)
+     * @param now           Current time in ms
+     *
+     * @returns true if the message was queued, false if it did not fit
+     */
+    bool push(uint8_t port, const uint8_t *data, size_t length, bool confirmed, uint8_t retries, uint8_t priority, uint32_t now) {
+        if (length == 0 || length > MBED_CONF_APP_UPLINK_QUEUE_MAX_PAYLOAD) {
+            return false;
+        }
+
+        entry_t *slot = NULL;
+        uint32_t sequence = _sequence;
+        uint16_t key = uplink_command_key(port, data, length);
+
+        // same port and command key, the new message supersedes the old one (unless it's already being sent),
+        // and keeps its place in the queue
+        for (size_t ix = 0; ix < MBED_CONF_APP_UPLINK_QUEUE_SIZE; ix++) {
+            entry_t *e = &_entries[ix];
+            if (e->in_use && !e->in_flight && e->port == port
+                    && uplink_command_key(e->port, e->data, e->length) == key) {
+                slot = e;
+                now = e->queued_at;
+                sequence = e->sequence;
+                break;
+            }
+        }
+
+        if (!slot) {
+            slot = find_free();
+        }
+
+        // queue is full, evict the newest message with a lower priority
+        bool evict = !slot;
+        if (evict) {
+            for (size_t ix = 0; ix < MBED_CONF_APP_UPLINK_QUEUE_SIZE; ix++) {
+                entry_t *e = &_entries[ix];
+                if (e->in_flight || e->priority <= priority) continue;
+                if (!slot || e->priority > slot->priority
+                        || (e->priority == slot->priority && e->sequence > slot->sequence)) {
+                    slot = e;
+                }
+            }
+        }
+
+        if (!slot) {
+            return false;
+        }
+
+        if (evict) {
+            tr_warn("Uplink queue full, dropped message on port %u (priority %u) for port %u (priority %u)",
+                slot->port, slot->priority, port, priority);
+        }
+
+        slot->in_use = true;
+        slot->in_flight = false;
+        slot->confirmed = confirmed;
+        slot->port = port;
+        slot->priority = priority;
+        slot->retries_left = retries;
+        slot->length = static_cast<uint8_t>(length);
+        slot->sequence = sequence;
+        if (sequence == _sequence) {
+            _sequence++;
+        }
+        slot->queued_at = now;
+        memcpy(slot->data, data, length);
+
+        return true;
+    }
+
+    /**
+     * Next message to send, or NULL if the queue is empty or a message is still in flight
+     */
+    entry_t *peek() {
+        entry_t *next = NULL;
+
+        for (size_t ix = 0; ix < MBED_CONF_APP_UPLINK_QUEUE_SIZE; ix++) {
+            entry_t *e = &_entries[ix];
+            if (!e->in_use) continue;
+            if (e->in_flight) return NULL;
+
+            if (!next || e->priority < next->priority
+                    || (e->priority == next->priority && e->sequence < next->sequence)) {
+                next = e;
+            }
+        }
+
+        return next;
+    }
+
+    /**
+     * Mark a message as handed to the LoRaWAN stack
+     */
+    void mark_in_flight(entry_t *e) {
+        e->in_flight = true;
+    }
+
+    /**
+     * The message that is in flight was sent, remove it from the queue
+     *
+     * @param now       Current time in ms
+     * @param port      Set to the port of the message
+     * @param waited    Set to the time the message spent in the queue (in ms)
+     *
+     * @returns true if a message was in flight
+     */
+    bool tx_done(uint32_t now, uint8_t &port, uint32_t &waited) {
+        entry_t *e = in_flight();
+        if (!e) return false;
+
+        port = e->port;
+        waited = now - e->queued_at;
+        e->in_use = false;
+        e->in_flight = false;
+        return true;
+    }
+
+    /**
+     * The message that is in flight failed to send, consume a retry
+     *
+     * @returns true if the message stays queued, false if it was dropped (or nothing was in flight)
+     */
+    bool tx_failed() {
+        entry_t *e = in_flight();
+        if (!e) return false;
+
+        e->in_flight = false;
+
+        if (e->retries_left == 0) {
+            e->in_use = false;
+            return false;
+        }
+
+        e->retries_left--;
+        return true;
+    }
+
+    entry_t *in_flight() {
+        for (size_t ix = 0; ix < MBED_CONF_APP_UPLINK_QUEUE_SIZE; ix++) {
+            if (_entries[ix].in_use && _entries[ix].in_flight) {
+                return &_entries[ix];
+            }
+        }
+        return NULL;
+    }
+
+    size_t count() const {
+        size_t c = 0;
+        for (size_t ix = 0; ix < MBED_CONF_APP_UPLINK_QUEUE_SIZE; ix++) {
+            if (_entries[ix].in_use) c++;
+        }
+        return c;
+    }
+
+    void clear() {
+        memset(_entries, 0, sizeof(_entries));
+    }
+
+private:
+    entry_t *find_free() {
+        for (size_t ix = 0; ix < MBED_CONF_APP_UPLINK_QUEUE_SIZE; ix++) {
+            if (!_entries[ix].in_use) {
+                return &_entries[ix];
+            }
+        }
+        return NULL;
+    }
+
+    entry_t _entries[MBED_CONF_APP_UPLINK_QUEUE_SIZE];
+    uint32_t _sequence;
+};
+
+#endif // _LORAWAN_FUOTA_UPLINK_QUEUE_HELPER_H
@@ -21,6 +21,18 @@
 #include "lora_radio_helper.h"
 #include "dev_eui_helper.h"
 #include "storage_helper.h"
+#include "benchmark_helper.h"
+#include "uplink_queue_helper.h"
+#include "tx_scheduler_helper.h"
+#include "frag_memory_helper.h"
+#include "block_cache_helper.h"
+#include "crypto_benchmark_helper.h"
+#include "uc_mailbox_helper.h"
+#include "trace_log_helper.h"
+#include "rx_latency_helper.h"
+#include "session_checkpoint_helper.h"
+#include "clock_drift_helper.h"
+#include "memory_helper.h"
 #include "UpdateCerts.h"
 #include "LoRaWANUpdateClient.h"
 
@@ -33,18 +45,87 @@ static uint8_t APP_KEY[] = { 0xB8, 0xB4, 0x33, 0x0D, 0xFD, 0xD5, 0xD8, 0x61, 0xE
 
 static void lora_event_handler(lorawan_event_t event);
 static void lora_uc_send(LoRaWANUpdateClientSendParams_t &params);
-static void queue_next_send_message();
+static void queue_next_send_message(uint32_t min_delay = 0);
 static void send_message();
+static void process_downlink(uint8_t port, uint8_t *buffer, size_t length);
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+static void session_resume_start();
+#endif
 
 static LoRaWANInterface lorawan(radio);
 static lorawan_app_callbacks_t callbacks;
-static LoRaWANUpdateClient uc(&bd, APP_KEY, lora_uc_send);
-static loramac_protocol_params class_a_params;  // @todo: this is 816 bytes, can we use a smaller structure?
-static LoRaWANUpdateClientClassCSession_t class_c_details;
+#if MBED_CONF_APP_FUOTA_BENCHMARK
+static BlockDevice *storage_bd = &benchmark_bd;
+#else
+static BlockDevice *storage_bd = &bd;
+#endif
+#if MBED_CONF_APP_RX_LATENCY
+static TimedBlockDevice timed_bd(storage_bd);
+static PageCacheBlockDevice cached_bd(&timed_bd);
+static RxLatency rx_latency;
+#else
+static PageCacheBlockDevice cached_bd(storage_bd);
+#endif
+static BlockDevice *uc_bd = &cached_bd;
+#if MBED_CONF_APP_MEM_PROFILE
+static MemProfile mem_profile;
+static MemProfileBlockDevice mem_profile_bd(uc_bd, &mem_profile);
+static LoRaWANUpdateClient uc(&mem_profile_bd, APP_KEY, lora_uc_send);
+#else
+static LoRaWANUpdateClient uc(uc_bd, APP_KEY, lora_uc_send);
+#endif
+
+// Only the parts of the Class A session that the Class C session overrides (instead of the full 816 byte session)
+typedef struct {
+    uint32_t dev_addr;
+    uint32_t ul_frame_counter;
+    uint32_t dl_frame_counter;
+    uint8_t nwk_skey[16];
+    uint8_t app_skey[16];
+    rx2_channel_params rx2_channel;
+} class_a_session_t;
+
+// Class C session of a multicast group, as announced by the update client
+typedef struct {
+    bool pending;                   // window is open, the device listens to it now or when the active session ends
+    bool left_early;                // device stopped listening because the fragmentation session completed
+    uint32_t ends_at;               // tick at which the update client closes the window
+    LoRaWANUpdateClientClassCSession_t details;
+} mc_class_c_session_t;
+
+static class_a_session_t class_a_session;
+static mc_class_c_session_t class_c_sessions[MC_GROUPS_MAX];
+static int8_t active_mc_group = -1;     // group whose Class C session the device listens to
+static uint8_t class_c_scheduled = 0;   // bit per group with a Class C session that did not close yet (mailbox retry is armed)
+static bool class_c_session_set = false; // Class C session is set in the stack (class A session is saved)
 static bool in_class_c_mode = false;
+static uint32_t session_dev_addr = 0;   // dev addr of the active session, cached so we don't need get_session() per fragment
 static bool clock_is_synced = false;
-static LoRaWANUpdateClientSendParams_t queued_message;
-static bool queued_message_waiting = false;
+static ClockDrift clock_drift;
+static UplinkQueue uplink_queue;
+static frag_session_setup_t frag_sessions[FRAG_SESSIONS_MAX];  // FragSessionSetupReq per frag index that was passed to the update client
+static uint8_t frag_sessions_active = 0;                        // bit per frag index
+static uint8_t frag_sessions_completed = 0;                     // bit per frag index, set by fragSessionComplete
+static uint8_t frag_sessions_done = 0;                          // bit per frag index, complete until the index is set up again
+static uint8_t current_frag_index = 0;                          // frag index of the command the update client is handling
+static TxScheduler tx_scheduler;
+static UpdateClientMailbox uc_mailbox;
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+static SessionCheckpoint session_checkpoint(&cached_bd, MBED_CONF_APP_SESSION_CHECKPOINT_ADDRESS);
+static uint16_t session_resume_next = 0;        // next data fragment to replay when resuming a session
+static bool session_resume_replaying = false;   // the stored setup is replayed, the server did not ask for the answers
+#endif
+
+// retry interval when the LoRaWAN stack refuses a message
+#define SEND_RETRY_DELAY_MS     1000
+
+// while rebooting waits for the device to become idle, check this often, and give up waiting after the max.
+#define REBOOT_IDLE_POLL_MS     1000
+#define REBOOT_IDLE_MAX_WAIT_MS 120000
+
+#if !MBED_CONF_LORAWAN_UPDATE_CLIENT_INTEROP_TESTING && MBED_CONF_APP_REBOOT_DELAY_MS >= 0
+static uint32_t reboot_requested_at = 0;
+#endif
 
 static DigitalOut led1(ACTIVITY_LED);
 
@@ -55,105 +136,504 @@ static void turn_led_off() {
     led1 = 0;
 }
 
-// This is already debounced to the eventqueue, so safe to run printf here
+static void switch_class_c_group(int8_t group);
+static void restore_class_a();
+
+// Length of a Class C window, SessionTimeOut is 2^timeOut seconds
+static uint32_t class_c_window_ms(const LoRaWANUpdateClientClassCSession_t *details) {
+    return (1UL << (details->timeOut & 0xf)) * 1000;
+}
+
+// Group with an open Class C window that the device does not listen to yet, -1 if there is none
+static int8_t next_class_c_group() {
+    uint32_t now = evqueue.tick();
+    int8_t next = -1;
+
+    for (int8_t group = 0; group < MC_GROUPS_MAX; group++) {
+        mc_class_c_session_t *session = &class_c_sessions[group];
+        if (!session->pending || session->left_early || group == active_mc_group) continue;
+
+        // window closed while another group was active
+        if (static_cast<int32_t>(session->ends_at - now) <= 0) {
+            session->pending = false;
+            continue;
+        }
+
+        if (next < 0 || static_cast<int32_t>(session->ends_at - class_c_sessions[next].ends_at) < 0) {
+            next = group;
+        }
+    }
+    return next;
+}
+
+// This runs on the eventqueue (through the mailbox), so safe to run printf here
 static void switch_to_class_a() {
-    printf("Switch to Class A\n");
+    // the update client does not say which group's window closed, so take the one that was due to close first
+    int8_t ended = -1;
+    for (int8_t group = 0; group < MC_GROUPS_MAX; group++) {
+        if (!class_c_sessions[group].pending) continue;
+        if (ended < 0 || static_cast<int32_t>(class_c_sessions[group].ends_at - class_c_sessions[ended].ends_at) < 0) {
+            ended = group;
+        }
+    }
+    if (ended >= 0) {
+        class_c_sessions[ended].pending = false;
+
+        class_c_scheduled &= ~(1 << ended);
+        if (class_c_scheduled == 0) {
+            uc_mailbox.disarm_retry();
+        }
+
+        // the device already left this window when the fragmentation session completed
+        if (class_c_sessions[ended].left_early) {
+            class_c_sessions[ended].left_early = false;
+            return;
+        }
+    }
+
+    if (in_class_c_mode && ended >= 0 && ended != active_mc_group) {
+        printf("Class C session of group %d ended before the device got to it\n", ended);
+        return;
+    }
+
+    // another group's window is still open, go straight to it
+    int8_t next = next_class_c_group();
+    if (in_class_c_mode && next >= 0) {
+        switch_class_c_group(next);
+        return;
+    }
+
+    restore_class_a();
+}
+
+// Put back the Class A session and start sending again
+static void restore_class_a() {
+    TRACE_LOG(TRACE_CLASS_A, 0, 0, 0, "Switch to Class A\n");
     turn_led_off();
+#if MBED_CONF_APP_TRACE_LOG
+    trace_log.log_heap(TRACE_HEAP_CLASS_A);
+#else
     uc.printHeapStats("CLASSA ");
+#endif
+
+#if MBED_CONF_APP_MEM_PROFILE
+    // the session did not complete (otherwise the profile reports when the firmware is ready)
+    if (mem_profile.phase() == MEM_PHASE_CLASS_C || mem_profile.phase() == MEM_PHASE_FEC) {
+        mem_profile.enter(MEM_PHASE_SETUP);
+        mem_profile.report();
+    }
+#endif
 
     in_class_c_mode = false;
+    active_mc_group = -1;
+
+    // put back the fields of the class A session that class C overrode (if the switch to class C got that far)
+    if (class_c_session_set) {
+        loramac_protocol_params params;
+        lorawan.get_session(&params);
 
-    // put back the class A session
-    lorawan.set_session(&class_a_params);
+        params.dev_addr = class_a_session.dev_addr;
+        params.ul_frame_counter = class_a_session.ul_frame_counter;
+        params.dl_frame_counter = class_a_session.dl_frame_counter;
+        memcpy(params.keys.nwk_skey, class_a_session.nwk_skey, 16);
+        memcpy(params.keys.app_skey, class_a_session.app_skey, 16);
+        params.sys_params.rx2_channel = class_a_session.rx2_channel;
+
+        lorawan.set_session(&params);
+        session_dev_addr = params.dev_addr;
+        class_c_session_set = false;
+    }
     lorawan.enable_adaptive_datarate();
     lorawan.set_device_class(CLASS_A);
 
-    // wait for a few seconds to send the message
-    evqueue.call_in(5000, &send_message);
+#if MBED_CONF_APP_RX_LATENCY
+    // stats for the Class C session that just ended
+    rx_latency.print();
+#if MBED_CONF_APP_RX_LATENCY_UPLINK_PORT != 0
+    MBED_STATIC_ASSERT(RX_LATENCY_UPLINK_LENGTH <= MBED_CONF_APP_UPLINK_QUEUE_MAX_PAYLOAD,
+        "uplink-queue-max-payload is too small for the RX latency uplink");
+
+    uint8_t latency_stats[RX_LATENCY_UPLINK_LENGTH];
+    size_t latency_stats_length = rx_latency.encode(latency_stats);
+    uplink_queue.push(MBED_CONF_APP_RX_LATENCY_UPLINK_PORT, latency_stats, latency_stats_length, false, 0,
+                      UPLINK_PRIORITY_LOW, evqueue.tick());
+#endif
+#endif
+
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+    // the session might be continued later, keep the fragments that came in since the last checkpoint
+    if (frag_sessions_active) {
+        session_checkpoint.save();
+    }
+#endif
+
+#if MBED_CONF_APP_TRACE_LOG
+    // print what was logged during the Class C session
+    trace_log.resume();
+#endif
+
+    // send as soon as the duty cycle allows
+    queue_next_send_message();
+}
+
+// Point the LoRaWAN session at the Class C session of the active multicast group
+static void set_class_c_session(loramac_protocol_params *params) {
+    const LoRaWANUpdateClientClassCSession_t *details = &class_c_sessions[active_mc_group].details;
+
+    params->dl_frame_counter = 0;
+    params->ul_frame_counter = 0;
+    params->dev_addr = details->deviceAddr;
+    memcpy(params->keys.nwk_skey, details->nwkSKey, 16);
+    memcpy(params->keys.app_skey, details->appSKey, 16);
+
+    params->sys_params.rx2_channel.frequency = details->downlinkFreq;
+    params->sys_params.rx2_channel.datarate = details->datarate;
+
+    lorawan.set_session(params);
+    session_dev_addr = params->dev_addr;
 }
 
 static void switch_class_c_rx2_params() {
+    // window closed before the stack was idle, or a second switch was scheduled
+    if (active_mc_group < 0 || class_c_session_set) return;
+
     loramac_protocol_params class_c_params;
+    lorawan.get_session(&class_c_params);
+
+    // store the class A fields that we're about to override (stack is idle now, so frame counters are final)
+    class_a_session.dev_addr = class_c_params.dev_addr;
+    class_a_session.ul_frame_counter = class_c_params.ul_frame_counter;
+    class_a_session.dl_frame_counter = class_c_params.dl_frame_counter;
+    memcpy(class_a_session.nwk_skey, class_c_params.keys.nwk_skey, 16);
+    memcpy(class_a_session.app_skey, class_c_params.keys.app_skey, 16);
+    class_a_session.rx2_channel = class_c_params.sys_params.rx2_channel;
+
+    // and change them to the class C params
+    set_class_c_session(&class_c_params);
+    class_c_session_set = true;
+    lorawan.set_device_class(CLASS_C);
+}
 
-    // copy them to the class C params...
-    memcpy(&class_c_params, &class_a_params, sizeof(loramac_protocol_params));
-    class_c_params.dl_frame_counter = 0;
-    class_c_params.ul_frame_counter = 0;
-    class_c_params.dev_addr = class_c_details.deviceAddr;
-    memcpy(class_c_params.keys.nwk_skey, class_c_details.nwkSKey, 16);
-    memcpy(class_c_params.keys.app_skey, class_c_details.appSKey, 16);
+// Already in Class C, listen to another group's session (the class A session stays saved)
+static void switch_class_c_group(int8_t group) {
+    const LoRaWANUpdateClientClassCSession_t *details = &class_c_sessions[group].details;
+    TRACE_LOG(TRACE_CLASS_C, details->datarate, group, details->downlinkFreq,
+        "Switch to Class C session of group %d (DR%u, %lu Hz)\n", group, details->datarate, details->downlinkFreq);
 
-    class_c_params.sys_params.rx2_channel.frequency = class_c_details.downlinkFreq;
-    class_c_params.sys_params.rx2_channel.datarate = class_c_details.datarate;
+    active_mc_group = group;
 
-    // and set the class C session
-    lorawan.set_session(&class_c_params);
-    lorawan.set_device_class(CLASS_C);
+    // still waiting for the stack to become idle, switch_class_c_rx2_params picks up the new group
+    if (!class_c_session_set) return;
+
+    loramac_protocol_params params;
+    lorawan.get_session(&params);
+    set_class_c_session(&params);
 }
 
-static void switch_to_class_c() {
-    printf("Switch to Class C\n");
+static void switch_to_class_c(int8_t group) {
+    const LoRaWANUpdateClientClassCSession_t *details = &class_c_sessions[group].details;
+    TRACE_LOG(TRACE_CLASS_C, details->datarate, group, details->downlinkFreq,
+        "Switch to Class C (group %d, DR%u, %lu Hz)\n", group, details->datarate, details->downlinkFreq);
     turn_led_on();
+#if MBED_CONF_APP_TRACE_LOG
+    trace_log.log_heap(TRACE_HEAP_CLASS_C);
+#endif
+#if MBED_CONF_APP_MEM_PROFILE
+    mem_profile.enter(MEM_PHASE_CLASS_C);
+#endif
+
+    // if nothing is on air we can switch right away, otherwise wait until its receive windows have closed
+    uint32_t switch_delay = 0;
+    if (lorawan.cancel_sending() != LORAWAN_STATUS_OK) {
+        switch_delay = tx_scheduler.rx_windows_closed_in(evqueue.tick());
+    }
 
-    lorawan.cancel_sending();
     lorawan.disable_adaptive_datarate();
 
-    if (queued_message_waiting) {
-        queued_message_waiting = false;
-        free(queued_message.data);
-    }
+    uplink_queue.clear();
 
     in_class_c_mode = true;
+    active_mc_group = group;
+
+#if MBED_CONF_APP_RX_LATENCY
+    rx_latency.reset();
+#endif
+
+    // actually switch to Class C when the LoRaWAN stack is idle
+    evqueue.call_in(switch_delay, &switch_class_c_rx2_params);
+}
+
+// The update client opened a Class C window for a multicast group
+static void class_c_session_started(const LoRaWANUpdateClientClassCSession_t *details) {
+    int8_t group = details->mcGroupIDHeader & (MC_GROUPS_MAX - 1);
+    mc_class_c_session_t *session = &class_c_sessions[group];
+
+    session->details = *details;
+    session->pending = true;
+    session->left_early = false;
+    session->ends_at = evqueue.tick() + class_c_window_ms(details);
 
-    // store the class A parameters
-    lorawan.get_session(&class_a_params);
+    if (!in_class_c_mode) {
+        switch_to_class_c(group);
+    }
+    else if (group == active_mc_group) {
+        switch_class_c_group(group);
+    }
+    else {
+        printf("Class C session of group %d overlaps with group %d, listening to it when that one ends\n", group, active_mc_group);
+    }
+}
 
-    // in 1.5 second, actually switch to Class C (allow clearing the queue in the LoRaWAN stack)
-    evqueue.call_in(1500, &switch_class_c_rx2_params);
+// These run in an interrupt routine (or in the context that calls the update client), so just post to the mailbox
+static void switch_to_class_a_irq() {
+    uc_mailbox.post(UC_EVENT_SWITCH_TO_CLASS_A);
 }
 
-// This runs in an interrupt routine, so just copy the parameter and dispatch to event queue
 static void switch_to_class_c_irq(LoRaWANUpdateClientClassCSession_t* session) {
-    core_util_critical_section_enter();
-    memcpy(&class_c_details, session, sizeof(LoRaWANUpdateClientClassCSession_t));
-    core_util_critical_section_exit();
+    uc_mailbox.post_class_c(session);
+}
+
+static void lorawan_uc_fragsession_complete_irq() {
+    // called from handleFragmentationCommand, so on the event queue, and current_frag_index is the completed session
+    frag_sessions_completed |= 1 << current_frag_index;
+#if MBED_CONF_APP_MEM_PROFILE
+    // the update client verifies (and patches) the image right after this returns
+    mem_profile.enter(MEM_PHASE_VERIFY);
+#endif
+    uc_mailbox.post(UC_EVENT_FRAG_SESSION_COMPLETE);
+}
+
+#if MBED_CONF_LORAWAN_UPDATE_CLIENT_INTEROP_TESTING
+static void lorawan_uc_firmware_ready_irq(uint32_t crc) {
+    uc_mailbox.post_firmware_ready(crc);
+}
+#else
+static void lorawan_uc_firmware_ready_irq() {
+    uc_mailbox.post(UC_EVENT_FIRMWARE_READY);
+}
+#endif
+
+// Tell the server that the session is complete (FragSessionStatusAns without missing fragments),
+// so it can stop sending once enough devices are done. Sent when the device is back in Class A.
+static void frag_session_report_complete(uint8_t frag_index) {
+    uint16_t received_and_index = (frag_index << 14) | (frag_sessions[frag_index].nb_frag & 0x3fff);
+    uint8_t ans[FRAG_SESSION_STATUS_ANS_LENGTH] = {
+        FRAG_SESSION_STATUS_ANS,
+        static_cast<uint8_t>(received_and_index & 0xff), static_cast<uint8_t>(received_and_index >> 8),
+        0 /* missing */, 0 /* status */
+    };
+
+    LoRaWANUpdateClientSendParams_t params;
+    params.port = 201;
+    params.data = ans;
+    params.length = sizeof(ans);
+    params.confirmed = false;
+    params.retriesAllowed = 0;
+    lora_uc_send(params);
+}
+
+// FragSessionStatusReq for a session that already completed, answered without the update client
+// The server asks after every pass, and a complete session has nothing left to look up
+static bool frag_session_status_local(const uint8_t *buffer, size_t length) {
+    if (length < 2 || buffer[0] != FRAG_SESSION_STATUS_REQ) return false;
+
+    uint8_t frag_index = (buffer[1] >> 1) & 0x3;
+    if (!(frag_sessions_done & (1 << frag_index))) return false;
 
-    evqueue.call(&switch_to_class_c);
+    // participants bit 0: only devices that miss fragments answer
+    if (buffer[1] & 0x1) {
+        frag_session_report_complete(frag_index);
+    }
+    return true;
 }
 
+#if MBED_CONF_APP_CLASS_C_EARLY_EXIT
+// Stop listening to the Class C windows of the groups whose fragmentation sessions completed,
+// rather than waiting for the update client to close them
+static void class_c_leave_completed(uint8_t completed) {
+    if (!in_class_c_mode) return;
+
+    for (uint8_t frag_index = 0; frag_index < FRAG_SESSIONS_MAX; frag_index++) {
+        if (!(completed & (1 << frag_index))) continue;
+
+        // a session without groups in its bitmask is taken to be for the group we listen to
+        uint8_t groups = frag_sessions[frag_index].mc_group_bitmask;
+        if (groups == 0 && active_mc_group >= 0) {
+            groups = 1 << active_mc_group;
+        }
+
+        for (int8_t group = 0; group < MC_GROUPS_MAX; group++) {
+            if ((groups & (1 << group)) && class_c_sessions[group].pending) {
+                class_c_sessions[group].left_early = true;
+            }
+        }
+    }
+
+    if (active_mc_group < 0 || !class_c_sessions[active_mc_group].left_early) return;
+
+    printf("Leaving the Class C session of group %d early, %lu ms before it closes\n",
+        active_mc_group, class_c_sessions[active_mc_group].ends_at - evqueue.tick());
+
+    int8_t next = next_class_c_group();
+    if (next >= 0) {
+        switch_class_c_group(next);
+        return;
+    }
+
+    restore_class_a();
+}
+#endif
+
 static void lorawan_uc_fragsession_complete() {
-    printf("Frag session is complete\n");
+#if MBED_CONF_APP_FUOTA_BENCHMARK
+    fuota_benchmark_frag_session_complete();
+#if MBED_CONF_APP_MEM_PROFILE
+    mem_profile.enter(MEM_PHASE_VERIFY);
+#endif
+#endif
+    // the benchmark calls this directly, rather than through the mailbox
+    uint8_t completed = frag_sessions_completed ? frag_sessions_completed : (1 << current_frag_index);
+    frag_sessions_completed = 0;
+
+    for (uint8_t frag_index = 0; frag_index < FRAG_SESSIONS_MAX; frag_index++) {
+        if (!(completed & (1 << frag_index))) continue;
+
+        TRACE_LOG(TRACE_FRAG_COMPLETE, frag_index, 0, 0, "Frag session %u is complete\n", frag_index);
+        frag_sessions_active &= ~(1 << frag_index);
+        frag_sessions_done |= 1 << frag_index;
+
+#if MBED_CONF_APP_CLASS_C_EARLY_EXIT
+        frag_session_report_complete(frag_index);
+#endif
+
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+        if (session_checkpoint.is_tracking(frag_index)) {
+            session_checkpoint.clear();
+        }
+#endif
+    }
+
+#if MBED_CONF_APP_RX_LATENCY
+    rx_latency.print();
+#endif
+
+    // write out the last (partial) page
+    cached_bd.sync();
+    cached_bd.print_stats();
+
+#if MBED_CONF_APP_CLASS_C_EARLY_EXIT
+    // no need to listen to the rest of the window
+    class_c_leave_completed(completed);
+#endif
 }
 
 #if MBED_CONF_LORAWAN_UPDATE_CLIENT_INTEROP_TESTING
 uint32_t interop_crc32 = 0x0;
 static void lorawan_uc_firmware_ready(uint32_t crc) {
+#if MBED_CONF_APP_FUOTA_BENCHMARK
+    fuota_benchmark_firmware_ready();
+#endif
+#if MBED_CONF_APP_MEM_PROFILE
+    mem_profile.report();
+#endif
     uc.printHeapStats("FWREADY ");
     printf("Firmware is ready, CRC32 hash is %08lx\n", crc);
     interop_crc32 = crc;
 }
 #else
-static void lorawan_uc_firmware_ready() {
-    uc.printHeapStats("FWREADY ");
-    printf("Firmware is ready, hit **RESET** to flash the firmware\n");
+#if MBED_CONF_APP_REBOOT_DELAY_MS >= 0
+// Reboot into the new firmware when the device has nothing left to send,
+// add conditions of the application here (e.g. not in the middle of a measurement).
+static void reboot_when_idle() {
+    bool idle = !in_class_c_mode && uplink_queue.count() == 0;
+
+    if (!idle && evqueue.tick() - reboot_requested_at < REBOOT_IDLE_MAX_WAIT_MS) {
+        evqueue.call_in(REBOOT_IDLE_POLL_MS, &reboot_when_idle);
+        return;
+    }
+
+    printf("Rebooting into the new firmware%s\n", idle ? "" : " (did not become idle)");
+    cached_bd.sync();
 
     // reboot system
     NVIC_SystemReset();
 }
 #endif
 
+static void lorawan_uc_firmware_ready() {
+    // for delta updates this includes applying the patch
+    cached_bd.print_stats();
+
+#if MBED_CONF_APP_MEM_PROFILE
+    mem_profile.report();
+#endif
+
+#if MBED_CONF_APP_FUOTA_BENCHMARK
+    fuota_benchmark_firmware_ready();
+    return;
+#endif
+    uc.printHeapStats("FWREADY ");
+
+    // the bootloader reads straight from flash
+    cached_bd.sync();
+
+#if MBED_CONF_APP_REBOOT_DELAY_MS < 0
+    printf("Firmware is ready, hit **RESET** to flash the firmware\n");
+#else
+    printf("Firmware is ready, rebooting in %d ms, once the device is idle\n", MBED_CONF_APP_REBOOT_DELAY_MS);
+    reboot_requested_at = evqueue.tick();
+    evqueue.call_in(MBED_CONF_APP_REBOOT_DELAY_MS, &reboot_when_idle);
+#endif
+}
+#endif
+
+// Runs on the eventqueue, handles the update client callbacks in the order they were posted
+static void uc_mailbox_drain() {
+    uc_event_t event;
+
+    while (uc_mailbox.take(&event)) {
+        switch (event) {
+            case UC_EVENT_SWITCH_TO_CLASS_A:
+                switch_to_class_a();
+                break;
+            case UC_EVENT_SWITCH_TO_CLASS_C:
+            {
+                LoRaWANUpdateClientClassCSession_t details;
+                while (uc_mailbox.read_class_c_session(&details)) {
+                    class_c_session_started(&details);
+                }
+                break;
+            }
+            case UC_EVENT_FRAG_SESSION_COMPLETE:
+                lorawan_uc_fragsession_complete();
+                break;
+            case UC_EVENT_FIRMWARE_READY:
+#if MBED_CONF_LORAWAN_UPDATE_CLIENT_INTEROP_TESTING
+                lorawan_uc_firmware_ready(uc_mailbox.get_firmware_crc());
+#else
+                lorawan_uc_firmware_ready();
+#endif
+                break;
+            default:
+                break;
+        }
+    }
+}
+
 static void lora_uc_send(LoRaWANUpdateClientSendParams_t &params) {
-    queued_message = params;
-    // copy the buffer
-    queued_message.data = (uint8_t*)malloc(params.length);
-    if (!queued_message.data) {
-        printf("ERR! Failed to allocate %u bytes for queued_message!\n", params.length);
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+    if (session_resume_replaying) {
+        printf("Not sending the answer on port %u to a replayed setup\n", params.port);
         return;
     }
-    memcpy(queued_message.data, params.data, params.length);
-    queued_message_waiting = true;
+#endif
 
-    // will be sent in the next iteration
+    // copies the buffer, will be sent in the next iteration
+    bool queued = uplink_queue.push(params.port, params.data, params.length, params.confirmed, params.retriesAllowed,
+                                    uplink_priority_for(params.port, params.data, params.length), evqueue.tick());
+    if (!queued) {
+        printf("ERR! Failed to queue %u bytes on port %u, uplink queue is full\n", params.length, params.port);
+    }
 }
 
 // Send a message over LoRaWAN - todo, check for duty cycle
@@ -170,38 +650,47 @@ static void send_message() {
         int16_t retcode = lorawan.send(201, buffer, sizeof(buffer), MSG_UNCONFIRMED_FLAG);
         if (retcode < 0) {
             printf("send_message for DATA_BLOCK_AUTH_REQ on port %d failed (%d)\n", 201, retcode);
-            queue_next_send_message();
+            queue_next_send_message(SEND_RETRY_DELAY_MS);
         }
         else {
-            printf("%d bytes scheduled for transmission on port %d\n", sizeof(buffer), 201);
+            tx_scheduler.on_send(evqueue.tick(), sizeof(buffer));
+            TRACE_LOG(TRACE_TX_SCHEDULED, 201, 0, sizeof(buffer), "%d bytes scheduled for transmission on port %d\n", sizeof(buffer), 201);
         }
         return;
     }
 #endif
 
-    // @todo: implement retries allowed
-    if (queued_message_waiting) {
+    UplinkQueue::entry_t *queued_message = uplink_queue.peek();
+    if (queued_message) {
         // detect if this is class c session start message
         // because if so, we should change the timeToStart to the current moment as we don't send immediately
-        if (queued_message.port == MCCONTROL_PORT && queued_message.length == MC_CLASSC_SESSION_ANS_LENGTH
-                && queued_message.data[0] == MC_CLASSC_SESSION_ANS) {
-            uc.updateClassCSessionAns(&queued_message);
+        if (queued_message->port == MCCONTROL_PORT && queued_message->length == MC_CLASSC_SESSION_ANS_LENGTH
+                && queued_message->data[0] == MC_CLASSC_SESSION_ANS) {
+            LoRaWANUpdateClientSendParams_t params;
+            params.port = queued_message->port;
+            params.data = queued_message->data;
+            params.length = queued_message->length;
+            params.confirmed = queued_message->confirmed;
+            params.retriesAllowed = queued_message->retries_left;
+            uc.updateClassCSessionAns(&params);
         }
 
         int16_t retcode = lorawan.send(
-            queued_message.port,
-            queued_message.data,
-            queued_message.length,
-            queued_message.confirmed ? MSG_CONFIRMED_FLAG : MSG_UNCONFIRMED_FLAG);
+            queued_message->port,
+            queued_message->data,
+            queued_message->length,
+            queued_message->confirmed ? MSG_CONFIRMED_FLAG : MSG_UNCONFIRMED_FLAG);
 
         if (retcode < 0) {
-            printf("send_message for queued_message on port %d failed (%d)\n", queued_message.port, retcode);
-            queue_next_send_message();
+            printf("send_message for queued_message on port %d failed (%d)\n", queued_message->port, retcode);
+            queue_next_send_message(SEND_RETRY_DELAY_MS);
         }
         else {
-            free(queued_message.data);
-            queued_message_waiting = false;
-            printf("%d bytes scheduled for transmission on port %d\n", queued_message.length, queued_message.port);
+            tx_scheduler.on_send(evqueue.tick(), queued_message->length);
+            // stays in the queue until TX_DONE, so it can be retried
+            uplink_queue.mark_in_flight(queued_message);
+            TRACE_LOG(TRACE_TX_SCHEDULED, queued_message->port, 0, queued_message->length,
+                "%d bytes scheduled for transmission on port %d\n", queued_message->length, queued_message->port);
         }
 
         return;
@@ -215,51 +704,123 @@ static void send_message() {
         return;
     }
 
+    // the clock could be off by more than the server's guard band by now
+    if (clock_drift.resync_due(evqueue.tick())) {
+        printf("Clock could be %lu ms off, requesting clock sync\n", clock_drift.predicted_error_ms(evqueue.tick()));
+        clock_drift.resync_requested(evqueue.tick());
+        uc.requestClockSync(true);
+        queue_next_send_message();
+        return;
+    }
+
     // otherwise just send a random message (this is where you'd put your sensor data)
     int r = rand();
     int16_t retcode = lorawan.send(15, (uint8_t*)(&r), sizeof(r), MSG_UNCONFIRMED_FLAG);
 
     if (retcode < 0) {
         printf("send_message for normal message on port %d failed (%d)\n", 15, retcode);
-        queue_next_send_message();
+        queue_next_send_message(SEND_RETRY_DELAY_MS);
     }
     else {
-        printf("%d bytes scheduled for transmission on port %d\n", sizeof(r), 15);
+        tx_scheduler.on_send(evqueue.tick(), sizeof(r));
+        TRACE_LOG(TRACE_TX_SCHEDULED, 15, 0, sizeof(r), "%d bytes scheduled for transmission on port %d\n", sizeof(r), 15);
     }
 }
 
-static void queue_next_send_message() {
+static void queue_next_send_message(uint32_t min_delay) {
     if (in_class_c_mode) return;
 
-    int backoff;
+    // the next uplink is either a queued update client message, or the application message
+    UplinkQueue::entry_t *next = uplink_queue.peek();
+    size_t length = next ? next->length : sizeof(int);
+
+    uint32_t delay = tx_scheduler.next_tx_in(evqueue.tick(), length);
+
+    // the stack has the final say on the duty cycle
+    int backoff = -1;
     lorawan.get_backoff_metadata(backoff);
 
-    if (backoff < 0) {
-        backoff = 5000;
+    if (backoff > static_cast<int>(delay)) {
+        delay = backoff;
+    }
+    if (min_delay > delay) {
+        delay = min_delay;
     }
 
-    evqueue.call_in(backoff, &send_message);
+    TRACE_LOG(TRACE_NEXT_UPLINK, tx_scheduler.get_datarate(), 0, delay,
+        "Next uplink in %lu ms (DR%u, %lu ms on air)\n", delay, tx_scheduler.get_datarate(), tx_scheduler.get_next_tx_toa());
+
+    evqueue.call_in(delay, &send_message);
 }
 
+#if MBED_CONF_APP_TRACE_LOG
+// Printing the trace log blocks on the UART, so don't while receiving fragments (restore_class_a() resumes it)
+static bool trace_log_idle() {
+    return !in_class_c_mode;
+}
+#endif
+
 int main() {
     printf("\nMbed OS 5 Firmware Update over LoRaWAN\n");
 
+#if MBED_CONF_APP_MEM_PROFILE
+    mem_profile.start();
+#endif
+
+#if MBED_CONF_APP_TRACE_LOG
+    // Log to the binary trace log instead, decode with fuota-server/decode-trace.js
+    trace_log.start(&evqueue, &trace_log_idle);
+#else
     // Enable trace output for this demo, so we can see what the LoRaWAN stack does
     mbed_trace_init();
     mbed_trace_exclude_filters_set("QSPIF");
+#endif
+
+#if MBED_CONF_APP_RX_LATENCY
+    rx_latency.start(&evqueue);
+#endif
+
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+    if (cached_bd.init() == BD_ERROR_OK) {
+        session_checkpoint.init();
+    }
+#endif
+
+#if MBED_CONF_APP_CRYPTO_BENCHMARK
+    crypto_benchmark_run();
+#endif
 
     if (lorawan.initialize(&evqueue) != LORAWAN_STATUS_OK) {
         printf("LoRa initialization failed!\n");
         return -1;
     }
 
-    // update client callbacks, note that these run in an ISR!
-    uc.callbacks.switchToClassA = evqueue.event(switch_to_class_a); // dispatch to eventqueue
+    // update client callbacks, note that these run in an ISR! They're handed to the eventqueue through the mailbox
+    if (uc_mailbox.start(&evqueue, &uc_mailbox_drain) != 0) {
+        printf("Failed to start update client mailbox\n");
+        return -1;
+    }
+
+    uc.callbacks.switchToClassA = switch_to_class_a_irq;
     uc.callbacks.switchToClassC = switch_to_class_c_irq;
 
+#if MBED_CONF_APP_FUOTA_BENCHMARK
+    // Run these directly, so the benchmark can time verification
+    uc.callbacks.fragSessionComplete = lorawan_uc_fragsession_complete;
+    uc.callbacks.firmwareReady = lorawan_uc_firmware_ready;
+
+    // Replay a packet file through the update client instead of connecting to the network
+    if (fuota_benchmark_start(&evqueue, &process_downlink) != 0) {
+        return -1;
+    }
+
+    evqueue.dispatch_forever();
+    return 0;
+#endif
+
     // These run in the context that calls the update client
-    uc.callbacks.fragSessionComplete = evqueue.event(lorawan_uc_fragsession_complete);
-    uc.callbacks.firmwareReady = evqueue.event(lorawan_uc_firmware_ready);
+    uc.callbacks.fragSessionComplete = lorawan_uc_fragsession_complete_irq;
+    uc.callbacks.firmwareReady = lorawan_uc_firmware_ready_irq;
 
     // prepare application callbacks
     callbacks.events = callback(lora_event_handler);
@@ -303,28 +864,196 @@ int main() {
 // This is called from RX_DONE, so whenever a message came in
 static void receive_message()
 {
-    uint8_t rx_buffer[255] = { 0 };
+    // static rather than on the stack, this runs for every fragment in a Class C session
+    // no need to clear it, the update client only looks at the first retcode bytes
+    static uint8_t rx_buffer[255];
     uint8_t port;
     int flags;
     int16_t retcode = lorawan.receive(rx_buffer, sizeof(rx_buffer), port, flags);
 
+#if MBED_CONF_APP_RX_LATENCY
+    rx_latency.received();
+#endif
+
     if (retcode < 0) {
-        printf("receive() - Error code %d\n", retcode);
+        TRACE_LOG(TRACE_RX_ERROR, 0, 0, retcode, "receive() - Error code %d\n", retcode);
         return;
     }
 
-    printf("Received %d bytes on port %u\n", retcode, port);
+    TRACE_LOG(TRACE_RX, port, 0, retcode, "Received %d bytes on port %u\n", retcode, port);
+
+    process_downlink(port, rx_buffer, retcode);
+}
+
+static void send_frag_session_setup_ans(uint8_t frag_index, uint8_t status)
+{
+    uint8_t ans[2] = { FRAG_SESSION_SETUP_ANS, static_cast<uint8_t>((frag_index << 6) | status) };
+
+    LoRaWANUpdateClientSendParams_t params;
+    params.port = 201;
+    params.data = ans;
+    params.length = sizeof(ans);
+    params.confirmed = false;
+    params.retriesAllowed = 0;
+    lora_uc_send(params);
+}
+
+// Check whether the fragmentation session in a FragSessionSetupReq fits in the heap that is left
+// If not, answer with 'not enough memory' directly, rather than letting the update client run out of heap
+static bool frag_session_fits(const uint8_t *buffer, size_t length)
+{
+    frag_session_setup_t setup;
+    if (!frag_session_setup_parse(buffer, length, &setup)) {
+        return true; // not a valid FragSessionSetupReq, the update client will deal with it
+    }
+
+    // the update client writes every session to the same slot, so a second session would overwrite the first one
+    if (frag_sessions_active & ~(1 << setup.frag_index)) {
+        printf("FragSession %u rejected, another session is active (one session at a time)\n", setup.frag_index);
+        send_frag_session_setup_ans(setup.frag_index, FRAG_SESSION_SETUP_ANS_INDEX_NOT_SUPPORTED);
+        return false;
+    }
+
+    uint32_t needed = frag_session_heap_needed(setup.nb_frag, setup.frag_size, MBED_CONF_LORAWAN_UPDATE_CLIENT_MAX_REDUNDANCY);
+    int32_t heap_free = frag_memory_heap_free();
 
+    if (heap_free >= 0) {
+        uint32_t budget = heap_free > MBED_CONF_APP_FRAG_SESSION_HEAP_RESERVE ? heap_free - MBED_CONF_APP_FRAG_SESSION_HEAP_RESERVE : 0;
+
+        // a session with the same index is replaced, so its memory comes back
+        if (frag_sessions_active & (1 << setup.frag_index)) {
+            const frag_session_setup_t *replaced = &frag_sessions[setup.frag_index];
+            budget += frag_session_heap_needed(replaced->nb_frag, replaced->frag_size, MBED_CONF_LORAWAN_UPDATE_CLIENT_MAX_REDUNDANCY);
+        }
+
+        printf("FragSession %u: %u x %u bytes needs %lu bytes of heap (%ld free, %d reserved)\n",
+            setup.frag_index, setup.nb_frag, setup.frag_size, needed, heap_free, MBED_CONF_APP_FRAG_SESSION_HEAP_RESERVE);
+
+        if (needed > budget) {
+            printf("Not enough memory for FragSession %u, max. redundancy that fits is %u (configured %d)\n",
+                setup.frag_index,
+                frag_session_max_redundancy(setup.nb_frag, setup.frag_size, MBED_CONF_LORAWAN_UPDATE_CLIENT_MAX_REDUNDANCY, budget),
+                MBED_CONF_LORAWAN_UPDATE_CLIENT_MAX_REDUNDANCY);
+
+            send_frag_session_setup_ans(setup.frag_index, FRAG_SESSION_SETUP_ANS_NOT_ENOUGH_MEMORY);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The update client accepted a FragSessionSetupReq, track the session from now on
+static void frag_session_accepted(const uint8_t *buffer, size_t length)
+{
+    frag_session_setup_t setup;
+    if (!frag_session_setup_parse(buffer, length, &setup)) return;
+
+    frag_sessions[setup.frag_index] = setup;
+    frag_sessions_active |= 1 << setup.frag_index;
+    frag_sessions_done &= ~(1 << setup.frag_index);
+}
+
+// Dispatch a downlink to the update client (or handle application data)
+static void process_downlink(uint8_t port, uint8_t *buffer, size_t length)
+{
     LW_UC_STATUS status = LW_UC_OK;
 
     if (port == 200) {
-        status = uc.handleMulticastControlCommand(rx_buffer, retcode);
+        int32_t corrected_s = clock_drift.correct_class_c_session_req(buffer, length, evqueue.tick());
+        if (corrected_s != 0) {
+            printf("Class C session start moved by %ld s for the drift of the clock (%ld ppm)\n", corrected_s, clock_drift.drift_ppm());
+        }
+
+        status = uc.handleMulticastControlCommand(buffer, length);
+
+        // the update client's timers will call back from an ISR, make sure a lost post gets retried
+        if (status == LW_UC_OK && length == MC_CLASSC_SESSION_REQ_LENGTH && buffer[0] == MC_CLASSC_SESSION_REQ) {
+            class_c_scheduled |= 1 << (buffer[1] & (MC_GROUPS_MAX - 1));
+            if (!uc_mailbox.arm_retry()) {
+                printf("Could not arm the update client mailbox retry (event queue full)\n");
+            }
+        }
+
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+        if (status == LW_UC_OK && length == MC_GROUP_SETUP_REQ_LENGTH && buffer[0] == MC_GROUP_SETUP_REQ) {
+            session_checkpoint.set_mc_group_setup(buffer, length);
+        }
+#endif
     }
     else if (port == 201) {
-        // retrieve current session and set dev addr
-        loramac_protocol_params params;
-        lorawan.get_session(&params);
-        status = uc.handleFragmentationCommand(params.dev_addr, rx_buffer, retcode);
+        if (length > 0 && buffer[0] == FRAG_SESSION_SETUP_REQ && !frag_session_fits(buffer, length)) {
+            return;
+        }
+        if (frag_session_status_local(buffer, length)) {
+            return;
+        }
+
+#if MBED_CONF_APP_RX_LATENCY
+        uint32_t uc_start = RxLatency::now_us();
+        uint32_t bd_start = timed_bd.busy_us;
+#endif
+
+        if (length >= 3 && buffer[0] == DATA_FRAGMENT) {
+            current_frag_index = buffer[2] >> 6;
+
+#if MBED_CONF_APP_MEM_PROFILE
+            // fragments past nb_frag are parity, the update client starts decoding
+            uint16_t n = buffer[1] | ((buffer[2] & 0x3f) << 8);
+            if ((frag_sessions_active & (1 << current_frag_index)) && n > frag_sessions[current_frag_index].nb_frag) {
+                mem_profile.enter(MEM_PHASE_FEC);
+            }
+#endif
+        }
+        else if (length > 1 && buffer[0] == FRAG_SESSION_SETUP_REQ) {
+            current_frag_index = (buffer[1] >> 4) & 0x3;
+        }
+
+#if MBED_HEAP_STATS_ENABLED
+        // a replaced session frees its memory first, so only a new session can be checked
+        mbed_stats_heap_t heap_before;
+        bool check_heap = length > 0 && buffer[0] == FRAG_SESSION_SETUP_REQ && !(frag_sessions_active & (1 << current_frag_index));
+        if (check_heap) {
+            mbed_stats_heap_get(&heap_before);
+        }
+#endif
+
+        status = uc.handleFragmentationCommand(session_dev_addr, buffer, length);
+
+        if (status == LW_UC_OK && length > 0 && buffer[0] == FRAG_SESSION_SETUP_REQ) {
+#if MBED_HEAP_STATS_ENABLED
+            // the heap estimate is written by hand against the update client, check it against what it took
+            if (check_heap) {
+                frag_session_heap_check(&heap_before, buffer[2] | (buffer[3] << 8), buffer[4], MBED_CONF_LORAWAN_UPDATE_CLIENT_MAX_REDUNDANCY);
+            }
+#endif
+            frag_session_accepted(buffer, length);
+        }
+
+#if MBED_CONF_APP_RX_LATENCY
+        if (length > 0 && buffer[0] == DATA_FRAGMENT) {
+            rx_latency.fragment(RxLatency::now_us() - uc_start, timed_bd.busy_us - bd_start);
+        }
+#endif
+
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+        if (status == LW_UC_OK && length > 0 && buffer[0] == FRAG_SESSION_SETUP_REQ) {
+            session_checkpoint.start(buffer, frag_sessions[current_frag_index]);
+        }
+        else if (status == LW_UC_OK && length >= 3 && buffer[0] == DATA_FRAGMENT) {
+            // write the checkpoint after this event, the next fragment is at least a second away
+            if (session_checkpoint.mark(current_frag_index, buffer[1] | ((buffer[2] & 0x3f) << 8))) {
+                evqueue.call(&session_checkpoint, &SessionCheckpoint::save);
+            }
+        }
+#endif
+
+#if MBED_CONF_APP_TRACE_LOG
+        // DATA_FRAGMENT: 1 byte command, 2 bytes index and N
+        if (length >= 3 && buffer[0] == DATA_FRAGMENT) {
+            trace_log.log(TRACE_FRAGMENT, buffer[2] >> 6, buffer[1] | ((buffer[2] & 0x3f) << 8), status);
+        }
+#endif
 
         // blink LED when receiving a packet in Class C mode
         if (in_class_c_mode) {
@@ -333,32 +1062,154 @@ static void receive_message()
         }
     }
     else if (port == 202) {
-        status = uc.handleClockSyncCommand(rx_buffer, retcode);
+        status = uc.handleClockSyncCommand(buffer, length);
         if (status == LW_UC_OK) {
             clock_is_synced = true;
+            clock_drift.on_time_ans(buffer, length, evqueue.tick());
         }
     }
     else {
-        printf("Data received on port %d (length %d): ", port, retcode);
+#if !MBED_CONF_APP_TRACE_LOG
+        printf("Data received on port %d (length %d): ", port, length);
 
-        for (uint8_t i = 0; i < retcode; i++) {
-            printf("%02x ", rx_buffer[i]);
+        for (size_t i = 0; i < length; i++) {
+            printf("%02x ", buffer[i]);
         }
         printf("\n");
+#endif
     }
 
     if (status != LW_UC_OK) {
-        printf("Failed to handle UC command on port %d, status %d\n", port, status);
+        TRACE_LOG(TRACE_UC_STATUS, port, 0, status, "Failed to handle UC command on port %d, status %d\n", port, status);
     }
+
+    // the update client posts from this thread too (fragSessionComplete, firmwareReady), pick up a post that failed
+    uc_mailbox.drain_if_pending();
+}
+
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+// Feed the data fragments that were received before the reset back into the update client, a few per event
+static void session_resume_step() {
+    static uint8_t packet[DATA_FRAGMENT_HEADER_LENGTH + 255];
+
+    const uint16_t nb_frag = session_checkpoint.nb_frag();
+    const uint8_t frag_size = session_checkpoint.frag_size();
+    const uint8_t frag_index = session_checkpoint.frag_index();
+    current_frag_index = frag_index;
+
+    for (uint8_t replayed = 0; replayed < SESSION_RESUME_BATCH && session_resume_next <= nb_frag; session_resume_next++) {
+        uint16_t n = session_resume_next;
+        if (!session_checkpoint.is_received(n)) continue;
+
+        packet[0] = DATA_FRAGMENT;
+        packet[1] = n & 0xff;
+        packet[2] = ((n >> 8) & 0x3f) | (frag_index << 6);
+
+        bd_addr_t addr = MBED_CONF_LORAWAN_UPDATE_CLIENT_SLOT0_FW_ADDRESS + static_cast<bd_addr_t>(n - 1) * frag_size;
+        if (cached_bd.read(packet + DATA_FRAGMENT_HEADER_LENGTH, addr, frag_size) != BD_ERROR_OK) {
+            printf("Could not read fragment %u, stopped resuming the session\n", n);
+            session_resume_next = 0;
+            return;
+        }
+
+        uc.handleFragmentationCommand(session_checkpoint.mc_addr(), packet, DATA_FRAGMENT_HEADER_LENGTH + frag_size);
+        replayed++;
+    }
+
+    if (session_resume_next <= nb_frag) {
+        evqueue.call(&session_resume_step);
+        return;
+    }
+
+    session_resume_next = 0;
+    printf("Resumed fragmentation session %u\n", frag_index);
+
+    // the FragSessionStatusAns tells the server which fragments are still missing
+    uint8_t status_req[2] = { FRAG_SESSION_STATUS_REQ, static_cast<uint8_t>((frag_index << 1) | 0x1 /* all participants */) };
+    uc.handleFragmentationCommand(session_dev_addr, status_req, sizeof(status_req));
+}
+
+// Resume a fragmentation session that was interrupted by a reset (see session_checkpoint_helper.h)
+static void session_resume_start() {
+    static bool tried = false;
+    if (tried) return;
+    tried = true;
+
+    if (!session_checkpoint.load()) return;
+
+    printf("Resuming fragmentation session, %u of %u fragments were received before the reset\n",
+        session_checkpoint.received(), session_checkpoint.nb_frag());
+
+    uint8_t mc_group_setup[MC_GROUP_SETUP_REQ_LENGTH];
+    memcpy(mc_group_setup, session_checkpoint.mc_group_setup(), sizeof(mc_group_setup));
+
+    uint8_t frag_setup[FRAG_SESSION_SETUP_REQ_LENGTH];
+    memcpy(frag_setup, session_checkpoint.frag_setup(), sizeof(frag_setup));
+
+    // McGroupSetupAns and FragSessionSetupAns would be unsolicited, the FragSessionStatusAns at the end tells the server
+    session_resume_replaying = true;
+    bool set_up = mc_group_setup[0] == MC_GROUP_SETUP_REQ
+        && uc.handleMulticastControlCommand(mc_group_setup, sizeof(mc_group_setup)) == LW_UC_OK
+        && frag_session_fits(frag_setup, sizeof(frag_setup))
+        && uc.handleFragmentationCommand(session_dev_addr, frag_setup, sizeof(frag_setup)) == LW_UC_OK;
+    session_resume_replaying = false;
+
+    if (!set_up) {
+        printf("Could not set up the fragmentation session again, not resuming\n");
+        session_checkpoint.clear();
+        return;
+    }
+    frag_session_accepted(frag_setup, sizeof(frag_setup));
+
+    session_resume_next = 1;
+    evqueue.call(&session_resume_step);
+}
+#endif
+
+// Frequency (Hz) of a channel index in the current channel plan, 0 if it's not in the plan
+static uint32_t channel_frequency(uint8_t channel) {
+    loramac_channel_t channels[LORA_MAX_NB_CHANNELS];
+    lorawan_channelplan_t plan;
+    plan.nb_channels = 0;
+    plan.channels = channels;
+
+    if (lorawan.get_channel_plan(plan) != LORAWAN_STATUS_OK) return 0;
+
+    for (uint8_t ix = 0; ix < plan.nb_channels && ix < LORA_MAX_NB_CHANNELS; ix++) {
+        if (channels[ix].id == channel) return channels[ix].ch_param.frequency;
+    }
+    return 0;
 }
 
 // Event handler
 static void lora_event_handler(lorawan_event_t event) {
+    // picks up update client events that could not schedule a drain (event queue was full)
+    uc_mailbox.drain_if_pending();
+
     switch (event) {
         case CONNECTED:
             printf("Connection - Successful\n");
 
+            {
+                // only place where we need to look at the session, afterwards dev addr is tracked on class switches
+                loramac_protocol_params params;
+                lorawan.get_session(&params);
+                session_dev_addr = params.dev_addr;
+            }
+
+#if MBED_CONF_APP_TRACE_LOG
+            trace_log.log_heap(TRACE_HEAP_CONNECTED);
+#else
             uc.printHeapStats("CONNECTED ");
+#endif
+
+#if MBED_CONF_APP_MEM_PROFILE
+            mem_profile.enter(MEM_PHASE_SETUP);
+#endif
+
+#if MBED_CONF_APP_SESSION_CHECKPOINT
+            session_resume_start();
+#endif
 
             queue_next_send_message();
             break;
@@ -367,7 +1218,21 @@ static void lora_event_handler(lorawan_event_t event) {
             break;
         case TX_DONE:
         {
-            printf("Message Sent to Network Server\n");
+            lorawan_tx_metadata tx_metadata;
+            if (lorawan.get_tx_metadata(tx_metadata) == LORAWAN_STATUS_OK) {
+                tx_scheduler.on_tx_done(evqueue.tick(), channel_frequency(tx_metadata.channel), tx_metadata.data_rate,
+                                        tx_metadata.tx_toa);
+            }
+
+            uint8_t port = 0;
+            uint32_t waited = 0;
+            if (uplink_queue.tx_done(evqueue.tick(), port, waited)) {
+                TRACE_LOG(TRACE_TX_DONE, port, 0, waited, "Message Sent to Network Server, uplink on port %u was queued for %lu ms\n", port, waited);
+            }
+            else {
+                TRACE_LOG(TRACE_TX_DONE, 0, 0, 0, "Message Sent to Network Server\n");
+            }
+
             queue_next_send_message();
             break;
         }
@@ -375,16 +1240,26 @@ static void lora_event_handler(lorawan_event_t event) {
         case TX_ERROR:
         case TX_CRYPTO_ERROR:
         case TX_SCHEDULING_ERROR:
-            printf("Transmission Error - EventCode = %d\n", event);
-            queue_next_send_message();
+            TRACE_LOG(TRACE_TX_ERROR, event, 0, 0, "Transmission Error - EventCode = %d\n", event);
+
+            if (uplink_queue.in_flight() && !uplink_queue.tx_failed()) {
+                printf("No retries left, dropped queued uplink\n");
+            }
+
+            queue_next_send_message(SEND_RETRY_DELAY_MS);
             break;
         case RX_DONE:
-            printf("Received message from Network Server\n");
+#if MBED_CONF_APP_RX_LATENCY
+            rx_latency.rx_done();
+            receive_message();
+            rx_latency.handled();
+#else
             receive_message();
+#endif
             break;
         case RX_TIMEOUT:
         case RX_ERROR:
-            printf("Error in reception - Code = %d\n", event);
+            TRACE_LOG(TRACE_RX_ERROR, event, 0, 0, "Error in reception - Code = %d\n", event);
             break;
         case JOIN_FAILURE:
             printf("OTAA Failed - Check Keys\n");